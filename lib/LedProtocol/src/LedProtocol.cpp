@@ -0,0 +1,459 @@
+#include "LedProtocol.h"
+
+#include <cmath>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "decodeHex8 assumes a little-endian CPU");
+
+bool parseHexByte(const char* s, uint8_t& out) {
+  const uint8_t hi = HEX_NIBBLES.value[(uint8_t)s[0]];
+  const uint8_t lo = HEX_NIBBLES.value[(uint8_t)s[1]];
+  if ((hi | lo) & 0x80) return false;
+  out = (uint8_t)((hi << 4) | lo);
+  return true;
+}
+
+// Validates and decodes 8 hex chars into 4 bytes, one 64-bit word at a time.
+// Per byte lane: range checks b >= lo and b > hi use the carry into bit 7 of
+// b + (0x80 - lo) and b + (0x7F - hi), which can't spill into the next lane
+// because every lane is < 0x80 to begin with.
+bool decodeHex8(const char* hex, uint8_t* out) {
+  constexpr uint64_t ONES = 0x0101010101010101ULL;
+  constexpr uint64_t HIGH = 0x8080808080808080ULL;
+  uint64_t x;
+  memcpy(&x, hex, sizeof(x));
+  if (x & HIGH) return false;
+
+  const uint64_t folded = x | (0x20 * ONES);  // 'A'-'F' -> 'a'-'f'
+  const uint64_t digit = (x + (0x80 - '0') * ONES) & ~(x + (0x7F - '9') * ONES) & HIGH;
+  const uint64_t letter = (folded + (0x80 - 'a') * ONES) & ~(folded + (0x7F - 'f') * ONES) & HIGH;
+  if ((digit | letter) != HIGH) return false;
+
+  // Nibble per lane: low 4 bits, plus 9 for letters ('a' & 0xF == 1).
+  const uint64_t nibbles = (x & (0x0F * ONES)) + (letter >> 7) * 9;
+
+  // Pair lanes (hi, lo) into one byte per 16-bit lane, then pack the lanes.
+  uint64_t bytes = ((nibbles << 4) & 0x00F000F000F000F0ULL) | ((nibbles >> 8) & 0x000F000F000F000FULL);
+  bytes = (bytes | (bytes >> 8)) & 0x0000FFFF0000FFFFULL;
+  bytes = (bytes | (bytes >> 16)) & 0xFFFFFFFFULL;
+  const uint32_t packed = (uint32_t)bytes;
+  memcpy(out, &packed, sizeof(packed));
+  return true;
+}
+
+// 8 chars per step through decodeHex8, the tail through the nibble table.
+bool decodeHex(const char* hex, size_t len, uint8_t* out) {
+  if (len % 2 != 0) return false;
+  const size_t bytes = len / 2;
+  size_t i = 0;
+  for (; i + 4 <= bytes; i += 4) {
+    if (!decodeHex8(hex + i * 2, out + i)) return false;
+  }
+  for (; i < bytes; i++) {
+    if (!parseHexByte(hex + i * 2, out[i])) return false;
+  }
+  return true;
+}
+
+bool decodeIndexedFrame(const char* hex, size_t len, uint8_t bits, const uint8_t* palette, uint8_t paletteSize,
+                        uint16_t leds, uint8_t* out) {
+  if ((bits != 1 && bits != 2 && bits != 4) || len != indexedFrameHexChars(leds, bits)) return false;
+  const uint8_t mask = (uint8_t)((1 << bits) - 1);
+  uint16_t led = 0;
+  for (size_t i = 0; i < len; i += 2) {
+    uint8_t packed;
+    if (!parseHexByte(hex + i, packed)) return false;
+    for (int shift = 8 - bits; shift >= 0 && led < leds; shift -= bits, led++) {
+      const uint8_t index = (packed >> shift) & mask;
+      if (index >= paletteSize) return false;
+      memcpy(out + (size_t)led * 3, palette + (size_t)index * 3, 3);
+    }
+  }
+  return true;
+}
+
+void hexStreamBegin(HexStreamDecoder& d, uint8_t* target, size_t expected) {
+  d = HexStreamDecoder();
+  d.target = target;
+  d.expected = expected;
+}
+
+bool hexStreamFeed(HexStreamDecoder& d, const uint8_t* data, size_t len) {
+  const char* p = reinterpret_cast<const char*>(data);
+  const char* end = p + len;
+
+  while (p < end) {
+    if (d.hasPending) {
+      const char pair[2] = {d.pending, *p++};
+      d.hasPending = false;
+      if (!parseHexByte(pair, d.target[d.decoded])) return false;
+      d.decoded++;
+      continue;
+    }
+    if (isSpace(*p)) {
+      if (d.decoded > 0) d.trailing = true;
+      p++;
+      continue;
+    }
+    if (d.trailing || d.decoded == d.expected) return false;
+    if (end - p >= 8 && d.expected - d.decoded >= 4 && decodeHex8(p, d.target + d.decoded)) {
+      p += 8;
+      d.decoded += 4;
+      continue;
+    }
+    if (end - p < 2) {
+      d.pending = *p++;
+      d.hasPending = true;
+      continue;
+    }
+    if (!parseHexByte(p, d.target[d.decoded])) return false;
+    p += 2;
+    d.decoded++;
+  }
+  return true;
+}
+
+bool hexStreamComplete(const HexStreamDecoder& d) {
+  return !d.hasPending && d.decoded == d.expected;
+}
+
+void inflateBegin(FrameInflater& z, uint8_t* out, uint32_t size) {
+  z = FrameInflater();
+  z.out = out;
+  z.size = size;
+}
+
+bool inflateFeed(FrameInflater& z, uint8_t b) {
+  if (z.failed) return false;
+  if (z.literals > 0) {
+    if (z.pos >= z.size) {
+      z.failed = true;
+      return false;
+    }
+    z.out[z.pos++] = b;
+    z.literals--;
+    return true;
+  }
+  if (z.argBytes == 0) {
+    z.op = b;
+    if (b < 0x80) {
+      z.literals = (uint16_t)(b + 1);
+    } else {
+      z.argBytes = b < 0xC0 ? 1 : 2;
+      z.arg = 0;
+    }
+    return true;
+  }
+
+  z.arg |= (uint16_t)b << (8 * (z.op < 0xC0 ? 0 : 2 - z.argBytes));
+  if (--z.argBytes > 0) return true;
+  if (z.op < 0xC0) {
+    const uint32_t len = (((uint32_t)(z.op & 0x3F) << 8) | z.arg) + 1;
+    if (len > z.size - z.pos) {
+      z.failed = true;
+      return false;
+    }
+    memset(z.out + z.pos, 0, len);
+    z.pos += len;
+  } else {
+    const uint32_t len = (uint32_t)(z.op & 0x3F) + 3;
+    const uint32_t distance = z.arg;
+    if (distance == 0 || distance > z.pos || len > z.size - z.pos) {
+      z.failed = true;
+      return false;
+    }
+    for (uint32_t i = 0; i < len; i++, z.pos++) z.out[z.pos] = z.out[z.pos - distance];
+  }
+  return true;
+}
+
+bool inflateComplete(const FrameInflater& z) {
+  return !z.failed && z.literals == 0 && z.argBytes == 0 && z.pos == z.size;
+}
+
+uint16_t crc16Update(uint16_t crc, uint8_t b) {
+  crc ^= (uint16_t)b << 8;
+  for (int i = 0; i < 8; i++) {
+    crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1);
+  }
+  return crc;
+}
+
+bool isBinFrameMagic(uint8_t b) {
+  return b >= BIN_FRAME_MAGIC && b <= BIN_FRAME_LZ_SEQ_MAGIC;
+}
+
+void binFrameBegin(BinFrameParser& p, uint8_t magic) {
+  p.sequenced = magic == BIN_FRAME_SEQ_MAGIC || magic == BIN_FRAME_LZ_SEQ_MAGIC;
+  p.compressed = magic == BIN_FRAME_LZ_MAGIC || magic == BIN_FRAME_LZ_SEQ_MAGIC;
+  p.seq = 0;
+  p.state = p.sequenced ? BIN_SEQ : BIN_COUNT_LO;
+  p.count = 0;
+  p.payloadLen = 0;
+  p.crc = 0xFFFF;
+  p.expectedCrc = 0;
+  p.received = 0;
+  p.inflater = FrameInflater();
+}
+
+bool binFrameFeed(BinFrameParser& p, uint8_t b, uint8_t* target, uint16_t leds) {
+  switch (p.state) {
+    case BIN_SEQ:
+      p.seq |= (uint32_t)b << (8 * p.received);
+      p.crc = crc16Update(p.crc, b);
+      if (++p.received == 4) {
+        p.received = 0;
+        p.state = BIN_COUNT_LO;
+      }
+      return false;
+    case BIN_COUNT_LO:
+      p.count = b;
+      p.crc = crc16Update(p.crc, b);
+      p.state = BIN_COUNT_HI;
+      return false;
+    case BIN_COUNT_HI:
+      p.count |= (uint16_t)b << 8;
+      p.crc = crc16Update(p.crc, b);
+      p.state = p.compressed ? BIN_LEN_LO : p.count > 0 ? BIN_PAYLOAD : BIN_CRC_LO;
+      return false;
+    case BIN_LEN_LO:
+      p.payloadLen = b;
+      p.crc = crc16Update(p.crc, b);
+      p.state = BIN_LEN_HI;
+      return false;
+    case BIN_LEN_HI:
+      p.payloadLen |= (uint16_t)b << 8;
+      p.crc = crc16Update(p.crc, b);
+      if (p.count == leds && target != nullptr) inflateBegin(p.inflater, target, (uint32_t)p.count * 3);
+      p.state = p.payloadLen > 0 ? BIN_PAYLOAD : BIN_CRC_LO;
+      return false;
+    case BIN_PAYLOAD:
+      if (p.compressed) {
+        if (p.inflater.out != nullptr) inflateFeed(p.inflater, b);
+      } else if (p.count == leds && target != nullptr) {
+        target[p.received] = b;
+      }
+      p.crc = crc16Update(p.crc, b);
+      if (++p.received >= (p.compressed ? (uint32_t)p.payloadLen : (uint32_t)p.count * 3)) {
+        p.state = BIN_CRC_LO;
+      }
+      return false;
+    case BIN_CRC_LO:
+      p.expectedCrc = b;
+      p.state = BIN_CRC_HI;
+      return false;
+    case BIN_CRC_HI:
+      p.expectedCrc |= (uint16_t)b << 8;
+      p.state = BIN_IDLE;
+      return true;
+    default:
+      p.state = BIN_IDLE;
+      return false;
+  }
+}
+
+bool binFrameDecoded(const BinFrameParser& p) {
+  return !p.compressed || p.inflater.out == nullptr || inflateComplete(p.inflater);
+}
+
+LineStatus lineFeed(LineAssembler& line, char c) {
+  if (c == '\r') return LINE_PENDING;
+  if (c == '\n') {
+    if (line.overflow) {
+      line.overflow = false;
+      line.len = 0;
+      return LINE_TOO_LONG;
+    }
+    line.buf[line.len] = '\0';
+    return LINE_READY;
+  }
+  if (line.overflow) return LINE_PENDING;
+  if (line.len >= line.maxChars) {
+    line.overflow = true;
+    return LINE_PENDING;
+  }
+  line.buf[line.len++] = c;
+  return LINE_PENDING;
+}
+
+void Response::set(const char* msg) {
+  snprintf(buf, cap, "%s", msg);
+}
+
+void Response::format(const char* fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  vsnprintf(buf, cap, fmt, args);
+  va_end(args);
+}
+
+void Response::append(const char* fmt, ...) {
+  const size_t len = strlen(buf);
+  if (len + 1 >= cap) return;
+  va_list args;
+  va_start(args, fmt);
+  vsnprintf(buf + len, cap - len, fmt, args);
+  va_end(args);
+}
+
+bool isSpace(char c) {
+  return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+// Splits the next whitespace-delimited token off `cursor` in place
+// (null-terminating it) and advances `cursor` past it.
+char* nextToken(char*& cursor) {
+  while (isSpace(*cursor)) cursor++;
+  if (*cursor == '\0') return nullptr;
+  char* tok = cursor;
+  while (*cursor != '\0' && !isSpace(*cursor)) cursor++;
+  if (*cursor != '\0') *cursor++ = '\0';
+  return tok;
+}
+
+bool nextInt(char*& cursor, int& out) {
+  char* tok = nextToken(cursor);
+  if (tok == nullptr) return false;
+  char* end;
+  long v = strtol(tok, &end, 10);
+  if (*end != '\0') return false;
+  out = (int)v;
+  return true;
+}
+
+bool atEnd(char* cursor) {
+  while (isSpace(*cursor)) cursor++;
+  return *cursor == '\0';
+}
+
+size_t trimEnd(char* s, size_t len) {
+  while (len > 0 && isSpace(s[len - 1])) s[--len] = '\0';
+  return len;
+}
+
+bool parseSeq(const char* tok, uint32_t& out) {
+  uint64_t v = 0;
+  if (*tok == '\0') return false;
+  for (; *tok != '\0'; tok++) {
+    if (*tok < '0' || *tok > '9') return false;
+    v = v * 10 + (uint64_t)(*tok - '0');
+    if (v > 0xFFFFFFFFULL) return false;
+  }
+  out = (uint32_t)v;
+  return true;
+}
+
+const CommandEntry* dispatchCommand(const CommandEntry* table, size_t count, char* args, Response& res) {
+  char* verb = nextToken(args);
+  if (verb == nullptr) return nullptr;
+  for (char* c = verb; *c != '\0'; c++) {
+    if (*c >= 'a' && *c <= 'z') *c -= 'a' - 'A';
+  }
+  for (size_t i = 0; i < count; i++) {
+    if (strcmp(verb, table[i].verb) == 0) {
+      table[i].handler(args, res);
+      return &table[i];
+    }
+  }
+  return nullptr;
+}
+
+void buildOutputLut(uint8_t lut[256], float gamma, uint8_t scale) {
+  for (int i = 0; i < 256; i++) {
+    lut[i] = (uint8_t)lroundf(scale * powf(i / 255.0f, gamma));
+  }
+}
+
+// Brightness scales each channel by brightness / 255 (FastLED's scale8).
+uint32_t estimateCurrentMa(uint32_t load, uint16_t leds, uint8_t brightness) {
+  return (uint32_t)leds * LED_IDLE_MA + (uint32_t)((uint64_t)load * brightness / (255UL * 255UL));
+}
+
+uint8_t limitBrightness(uint32_t load, uint16_t leds, uint8_t brightness, uint32_t budgetMa) {
+  if (budgetMa == 0 || estimateCurrentMa(load, leds, brightness) <= budgetMa) return brightness;
+  const uint32_t idleMa = (uint32_t)leds * LED_IDLE_MA;
+  if (budgetMa <= idleMa) return 0;
+  const uint64_t fit = (uint64_t)(budgetMa - idleMa) * (255UL * 255UL) / load;
+  return fit < brightness ? (uint8_t)fit : brightness;
+}
+
+uint8_t timelineSegment(const uint32_t* atMs, uint8_t count, uint32_t t, uint8_t& amount) {
+  uint8_t k = 0;
+  while (k < count && atMs[k] <= t) k++;
+  if (k == count) {
+    amount = 255;
+    return count - 1;
+  }
+  const uint32_t from = k == 0 ? 0 : atMs[k - 1];
+  amount = (uint8_t)(((uint64_t)(t - from) * 255) / (atMs[k] - from));
+  return k;
+}
+
+uint16_t gridWiringPosition(const GridGeometry& g, uint16_t col, uint16_t row) {
+  uint16_t c = g.startRight ? g.cols - 1 - col : col;
+  uint16_t r = g.startBottom ? g.rows - 1 - row : row;
+  if (g.columnMajor) {
+    if (g.serpentine && (c & 1)) r = g.rows - 1 - r;
+    return c * g.rows + r;
+  }
+  if (g.serpentine && (r & 1)) c = g.cols - 1 - c;
+  return r * g.cols + c;
+}
+
+// Parses "<col>,<row>" at `s`, leaving `s` past it.
+static bool parseGridCell(const char*& s, uint16_t& col, uint16_t& row) {
+  uint32_t v[2] = {0, 0};
+  for (int k = 0; k < 2; k++) {
+    if (k == 1 && *s++ != ',') return false;
+    if (*s < '0' || *s > '9') return false;
+    for (; *s >= '0' && *s <= '9'; s++) {
+      v[k] = v[k] * 10 + (uint32_t)(*s - '0');
+      if (v[k] > 0xFFFF) return false;
+    }
+  }
+  col = (uint16_t)v[0];
+  row = (uint16_t)v[1];
+  return true;
+}
+
+bool parseGridRect(const char* tok, GridRect& out) {
+  uint16_t c0, r0, c1, r1;
+  if (!parseGridCell(tok, c0, r0)) return false;
+  if (*tok == '\0') {
+    c1 = c0;
+    r1 = r0;
+  } else if (*tok++ != ':' || !parseGridCell(tok, c1, r1) || *tok != '\0') {
+    return false;
+  }
+  out.col0 = c0 < c1 ? c0 : c1;
+  out.col1 = c0 < c1 ? c1 : c0;
+  out.row0 = r0 < r1 ? r0 : r1;
+  out.row1 = r0 < r1 ? r1 : r0;
+  return true;
+}
+
+void recordLatency(LatencyStat& st, uint32_t us) {
+  uint8_t bucket = 0;
+  while (bucket < LATENCY_BUCKETS - 1 && us >= ((uint32_t)LATENCY_BUCKET0_US << bucket)) bucket++;
+  st.buckets[bucket]++;
+  st.count++;
+  st.totalUs += us;
+  if (us > st.maxUs) st.maxUs = us;
+}
+
+uint32_t latencyPercentile(const LatencyStat& st, uint8_t pct) {
+  if (st.count == 0) return 0;
+  const uint32_t rank = (uint32_t)(((uint64_t)st.count * pct + 99) / 100);
+  uint32_t seen = 0;
+  for (uint8_t i = 0; i < LATENCY_BUCKETS - 1; i++) {
+    seen += st.buckets[i];
+    if (seen >= rank) {
+      const uint32_t bound = (uint32_t)LATENCY_BUCKET0_US << i;
+      return bound < st.maxUs ? bound : st.maxUs;
+    }
+  }
+  return st.maxUs;
+}
@@ -0,0 +1,274 @@
+#pragma once
+
+// Hardware-independent core of the LED wall protocol: hex and binary frame
+// decoding, serial line assembly, the command tokenizer and dispatcher, the
+// output gamma/power model, timeline positions, the hold grid and latency
+// histograms.
+// Nothing here touches Arduino, FastLED or FreeRTOS, so the same code runs in
+// the firmware (src/main.cpp) and in the host-side tests and benchmarks under
+// test/ (`pio test -e native`).
+
+#include <cstddef>
+#include <cstdint>
+
+#define BIN_FRAME_MAGIC 0xA5
+#define BIN_FRAME_SEQ_MAGIC 0xA6
+#define BIN_FRAME_LZ_MAGIC 0xA7
+#define BIN_FRAME_LZ_SEQ_MAGIC 0xA8
+#define LATENCY_BUCKETS 12  // bucket i: under LATENCY_BUCKET0_US << i; the last is open-ended
+#define LATENCY_BUCKET0_US 16
+#define LED_RED_MA 16  // WS2812B draw per channel at full duty (FastLED's power model)
+#define LED_GREEN_MA 11
+#define LED_BLUE_MA 15
+#define LED_IDLE_MA 1  // per LED, even when dark
+
+// ---- Hex ----
+
+// Hex digit value (0-15) for every byte, 0x80 for anything that isn't one.
+struct HexNibbleTable {
+  uint8_t value[256];
+
+  constexpr HexNibbleTable() : value() {
+    for (int c = 0; c < 256; c++) {
+      value[c] = (c >= '0' && c <= '9')   ? c - '0'
+                 : (c >= 'A' && c <= 'F') ? 10 + (c - 'A')
+                 : (c >= 'a' && c <= 'f') ? 10 + (c - 'a')
+                                          : 0x80;
+    }
+  }
+};
+
+constexpr HexNibbleTable HEX_NIBBLES;
+
+bool parseHexByte(const char* s, uint8_t& out);
+bool decodeHex8(const char* hex, uint8_t* out);
+
+// Decodes `len` hex chars (len must be even) into len / 2 bytes at `out`.
+bool decodeHex(const char* hex, size_t len, uint8_t* out);
+
+// Palette-indexed frames: one index per LED, `bits` (1, 2 or 4) wide, packed
+// MSB first and hex-encoded; the last byte is zero-padded.
+inline size_t indexedFrameHexChars(uint16_t leds, uint8_t bits) {
+  return ((size_t)leds * bits + 7) / 8 * 2;
+}
+
+// Expands an indexed frame into r, g, b triples at `out`. `palette` holds
+// `paletteSize` r, g, b triples; an index past its end fails the frame.
+bool decodeIndexedFrame(const char* hex, size_t len, uint8_t bits, const uint8_t* palette, uint8_t paletteSize,
+                        uint16_t leds, uint8_t* out);
+
+// Incremental decoder for a hex payload that arrives in chunks (POST /frame
+// bodies). Surrounding whitespace is skipped; a byte may straddle two chunks.
+struct HexStreamDecoder {
+  uint8_t* target = nullptr;
+  size_t expected = 0;  // bytes a complete payload holds
+  size_t decoded = 0;   // bytes written to target
+  char pending = 0;     // first char of a byte split across two chunks
+  bool hasPending = false;
+  bool trailing = false;  // whitespace seen after the payload
+};
+
+void hexStreamBegin(HexStreamDecoder& d, uint8_t* target, size_t expected);
+
+// Returns false as soon as the payload can't be valid (bad digit, too long,
+// text after trailing whitespace); the decoder is then spent.
+bool hexStreamFeed(HexStreamDecoder& d, const uint8_t* data, size_t len);
+
+bool hexStreamComplete(const HexStreamDecoder& d);
+
+// ---- Compressed frames ----
+
+// A compressed frame payload is a sequence of ops, decoded straight into the
+// frame; copies read back from the bytes already decoded, so no scratch
+// buffer or window is needed:
+//   0x00-0x7F  op + 1 literal bytes follow
+//   0x80-0xBF  (((op & 0x3F) << 8) | next byte) + 1 zero bytes
+//   0xC0-0xFF  copy (op & 0x3F) + 3 bytes from `distance` (next two bytes,
+//              u16 LE) back; copies may overlap, so distance 3 repeats a pixel
+struct FrameInflater {
+  uint8_t* out = nullptr;
+  uint32_t size = 0;  // bytes the payload must decode to
+  uint32_t pos = 0;
+  uint8_t op = 0;
+  uint8_t argBytes = 0;   // argument bytes of `op` still to read
+  uint16_t arg = 0;
+  uint16_t literals = 0;  // literal bytes still to read
+  bool failed = false;
+};
+
+void inflateBegin(FrameInflater& z, uint8_t* out, uint32_t size);
+
+// Returns false once the payload is invalid (it would overrun the frame or
+// copy from before its start).
+bool inflateFeed(FrameInflater& z, uint8_t b);
+
+// True when the payload decoded to exactly `size` bytes.
+bool inflateComplete(const FrameInflater& z);
+
+// ---- Binary frames ----
+
+uint16_t crc16Update(uint16_t crc, uint8_t b);
+
+enum BinFrameState : uint8_t {
+  BIN_IDLE,
+  BIN_SEQ,
+  BIN_COUNT_LO,
+  BIN_COUNT_HI,
+  BIN_LEN_LO,
+  BIN_LEN_HI,
+  BIN_PAYLOAD,
+  BIN_CRC_LO,
+  BIN_CRC_HI,
+};
+
+// Parser state for one binary frame packet (layout in src/main.cpp).
+struct BinFrameParser {
+  BinFrameState state = BIN_IDLE;
+  bool sequenced = false;
+  bool compressed = false;
+  uint32_t seq = 0;
+  uint16_t count = 0;
+  uint16_t payloadLen = 0;  // compressed packets: payload bytes on the wire
+  uint16_t crc = 0;
+  uint16_t expectedCrc = 0;
+  uint32_t received = 0;
+  FrameInflater inflater;
+};
+
+bool isBinFrameMagic(uint8_t b);
+void binFrameBegin(BinFrameParser& p, uint8_t magic);
+
+// Feeds one packet byte after the magic. Payload bytes are decoded into
+// `target` (r, g, b per LED) only when the packet's count equals `leds` and
+// target is set; other packets are still consumed so the stream stays in
+// sync. Returns true once the packet is complete; then check count, crc and
+// binFrameDecoded().
+bool binFrameFeed(BinFrameParser& p, uint8_t b, uint8_t* target, uint16_t leds);
+
+// For a complete packet that was decoded into a target: true unless its
+// compressed payload was invalid or didn't fill the frame.
+bool binFrameDecoded(const BinFrameParser& p);
+
+// ---- Serial lines ----
+
+enum LineStatus : uint8_t {
+  LINE_PENDING,
+  LINE_READY,     // buf holds a NUL-terminated line
+  LINE_TOO_LONG,  // an overlong line was discarded up to its newline
+};
+
+struct LineAssembler {
+  char* buf;        // capacity maxChars + 1
+  size_t maxChars;
+  size_t len = 0;
+  bool overflow = false;
+
+  LineAssembler(char* b, size_t max) : buf(b), maxChars(max) {}
+};
+
+// Feeds one char; '\r' is ignored. The caller resets len after a line.
+LineStatus lineFeed(LineAssembler& line, char c);
+
+// ---- Commands ----
+
+struct Response {
+  char* buf;
+  size_t cap;
+
+  void set(const char* msg);
+  void format(const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+  void append(const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+
+  bool ok() const {
+    return buf[0] == 'O' && buf[1] == 'K';
+  }
+};
+
+bool isSpace(char c);
+char* nextToken(char*& cursor);
+bool nextInt(char*& cursor, int& out);
+bool atEnd(char* cursor);
+
+// Trims trailing whitespace in place; returns the new length.
+size_t trimEnd(char* s, size_t len);
+
+// Decimal uint32; rejects anything else, including overflow.
+bool parseSeq(const char* tok, uint32_t& out);
+
+typedef void (*CommandHandler)(char* args, Response& res);
+
+struct CommandEntry {
+  const char* verb;
+  CommandHandler handler;
+};
+
+// Upper-cases the next token of `args` as a verb and runs the matching entry.
+// Returns the entry that ran, or nullptr if none matched.
+const CommandEntry* dispatchCommand(const CommandEntry* table, size_t count, char* args, Response& res);
+
+// ---- Output ----
+
+// Fills `lut` with scale * (i / 255) ^ gamma, rounded: one channel's gamma
+// and calibration in a single table lookup.
+void buildOutputLut(uint8_t lut[256], float gamma, uint8_t scale);
+
+// One pixel's share of the frame's current draw at full brightness, in units
+// of 1/255 mA. Summed over a frame this stays well inside uint32_t.
+inline uint32_t pixelLoad(uint8_t r, uint8_t g, uint8_t b) {
+  return (uint32_t)r * LED_RED_MA + (uint32_t)g * LED_GREEN_MA + (uint32_t)b * LED_BLUE_MA;
+}
+
+// Estimated draw in mA of a frame with summed pixelLoad `load` at `brightness`.
+uint32_t estimateCurrentMa(uint32_t load, uint16_t leds, uint8_t brightness);
+
+// Highest brightness up to `brightness` whose estimate fits in `budgetMa`
+// (0: unlimited).
+uint8_t limitBrightness(uint32_t load, uint16_t leds, uint8_t brightness, uint32_t budgetMa);
+
+// ---- Timelines ----
+
+// Where `t` ms falls in a timeline of `count` (>= 1) keyframes at strictly
+// increasing `atMs`: returns the keyframe being approached and sets `amount`
+// to the progress (0-255) towards it from the one before (from the starting
+// frame, before the first). Past the last keyframe: the last one, at 255.
+uint8_t timelineSegment(const uint32_t* atMs, uint8_t count, uint32_t t, uint8_t& amount);
+
+// ---- Hold grid ----
+
+// How a cols x rows grid of holds is wired: the corner the strip starts in,
+// whether it runs along rows or columns, and whether every other line runs
+// back the other way (serpentine).
+struct GridGeometry {
+  uint16_t cols = 1;
+  uint16_t rows = 1;
+  bool columnMajor = false;
+  bool startRight = false;
+  bool startBottom = false;
+  bool serpentine = false;
+};
+
+// Position along the wiring (0 .. cols * rows - 1) of the hold at col, row,
+// counted from the top left.
+uint16_t gridWiringPosition(const GridGeometry& g, uint16_t col, uint16_t row);
+
+struct GridRect {
+  uint16_t col0, row0, col1, row1;  // inclusive, col0 <= col1 and row0 <= row1
+};
+
+// Parses "<col>,<row>" or a rectangle "<col>,<row>:<col>,<row>" given by any
+// two opposite corners. Bounds are left to the caller.
+bool parseGridRect(const char* tok, GridRect& out);
+
+// ---- Latency histograms ----
+
+struct LatencyStat {
+  uint32_t count = 0;
+  uint64_t totalUs = 0;
+  uint32_t maxUs = 0;
+  uint32_t buckets[LATENCY_BUCKETS] = {};
+};
+
+void recordLatency(LatencyStat& st, uint32_t us);
+
+// Upper bound of the bucket holding the pct-th percentile, capped at the max.
+uint32_t latencyPercentile(const LatencyStat& st, uint8_t pct);
@@ -0,0 +1,99 @@
+"""
+End-to-end throughput benchmark for the ESP32 LED wall firmware.
+
+Hammers the device over serial and/or Wi-Fi and reports ops/sec plus p50/p99
+latency per path, then runs the firmware's own `BENCH` command so host-side
+and device-side numbers can be compared across firmware builds:
+
+    python3 bench.py --port /dev/ttyUSB0 --host 192.168.0.5 --count 200
+
+Frames alternate between two patterns so every update really changes pixels,
+and they leave the wall lit; run `CLEAR` afterwards if needed.
+"""
+
+import argparse
+import random
+import statistics
+import time
+
+from ledwall import LedSerialController, LedWifiController
+from ledwall.frame_codec import encode_binary_frame, encode_hex_frame
+
+
+def percentile(samples: list[float], pct: float) -> float:
+    ordered = sorted(samples)
+    k = min(len(ordered) - 1, max(0, round(pct / 100 * (len(ordered) - 1))))
+    return ordered[k]
+
+
+def run(name: str, count: int, op) -> None:
+    samples: list[float] = []
+    errors = 0
+    t_start = time.perf_counter()
+    for i in range(count):
+        t0 = time.perf_counter()
+        try:
+            resp = op(i)
+            if not resp.startswith("OK"):
+                errors += 1
+        except Exception:
+            errors += 1
+        samples.append((time.perf_counter() - t0) * 1000)
+    elapsed = time.perf_counter() - t_start
+    print(
+        f"{name:<14} {count / elapsed:8.1f} ops/s  "
+        f"p50 {statistics.median(samples):7.2f} ms  p99 {percentile(samples, 99):7.2f} ms  "
+        f"max {max(samples):7.2f} ms  errors {errors}"
+    )
+
+
+def make_frames(num_leds: int) -> list[list[tuple[int, int, int]]]:
+    rng = random.Random(1234)
+    return [[(rng.randrange(256), rng.randrange(256), rng.randrange(256)) for _ in range(num_leds)] for _ in range(2)]
+
+
+def bench_serial(port: str | None, count: int, device_iterations: int) -> None:
+    ctrl = LedSerialController(port=port)
+    print(f"Serial: {ctrl.connect()}")
+    num_leds = ctrl.info().num_leds or 35
+    frames = make_frames(num_leds)
+    # The frame paths go through the controller's transport directly so each
+    # op is exactly one request, with no diff cache or fallbacks.
+    run("serial PING", count, lambda i: ctrl.send("PING"))
+    run("serial FRAME", count, lambda i: ctrl.send(f"FRAME {encode_hex_frame(frames[i % 2])}"))
+    run("serial binary", count, lambda i: ctrl._transact(encode_binary_frame(frames[i % 2]), "binary frame", 2.0))
+    print(ctrl.send(f"BENCH {device_iterations}", timeout_s=30.0))
+    ctrl.close()
+
+
+def bench_wifi(host: str, count: int, device_iterations: int) -> None:
+    ctrl = LedWifiController(host=host, retries=0)
+    print(f"Wi-Fi: {ctrl.connect()}")
+    num_leds = ctrl.info().num_leds or 35
+    frames = make_frames(num_leds)
+    run("wifi /cmd", count, lambda i: ctrl.send("PING"))
+    run("wifi /frame", count, lambda i: ctrl._send_frame_fast(frames[i % 2]))
+    run("wifi stream", count, lambda i: ctrl._send_frame_stream(frames[i % 2]))
+    print(ctrl.send(f"BENCH {device_iterations}"))
+    ctrl.close()
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--port", help="Serial port like COM5 or /dev/ttyUSB0")
+    parser.add_argument("--serial", action="store_true", help="Benchmark serial (implied by --port)")
+    parser.add_argument("--host", help="ESP32 IP address to benchmark over Wi-Fi")
+    parser.add_argument("--count", type=int, default=200, help="Requests per path")
+    parser.add_argument("--device-iterations", type=int, default=100, help="Iterations for the on-device BENCH")
+    args = parser.parse_args()
+
+    if not (args.port or args.serial or args.host):
+        parser.error("give --port/--serial and/or --host")
+    if args.port or args.serial:
+        bench_serial(args.port, args.count, args.device_iterations)
+    if args.host:
+        bench_wifi(args.host, args.count, args.device_iterations)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,317 @@
+"""
+Frame encodings shared by the serial and Wi-Fi transports.
+
+Binary packet layout (see the header comment in `src/main.cpp`):
+
+    0xA5 | count (u16 LE) | rgb * count | CRC-16/CCITT-FALSE of count+rgb (u16 LE)
+
+or, tagged with a sequence number (CRC then also covers the seq):
+
+    0xA6 | seq (u32 LE) | count (u16 LE) | rgb * count | CRC-16 (u16 LE)
+
+Firmware that lists `LZ 1` in its INFO reply also takes the rgb bytes
+compressed (0xA7, or 0xA8 with a seq), with a payload length after the count:
+
+    0xA7 | count (u16 LE) | len (u16 LE) | ops * len | CRC-16 (u16 LE)
+
+The ops are literals, zero runs and copies from earlier in the frame (see
+`compress_frame`).
+
+Text commands are tagged with a `@<seq> ` prefix. The firmware drops updates
+older than the newest one it applied (last-writer-wins).
+
+Frames drawn from a few colors (routes) can be sent as palette indices: the
+colors are uploaded once with `PALETTE`, then `PFRAME <bits> <hex>` carries
+1, 2 or 4 bits per LED, packed MSB first.
+
+Several controllers present on the same tick by sharing a clock: `TIME`
+reads and adjusts the device's millisecond clock, aligned to `clock_ms()`
+from the fastest of a few round trips, and `AT <ms>` holds presentation until
+that clock reaches ms.
+
+Timelines (`TIMELINE KEY/PLAY`) upload a few keyframes that the firmware
+interpolates between on its own.
+
+The Wi-Fi firmware pushes what it shows as server-sent `state` events on
+`GET /events`, with the frame hex-encoded as for `encode_hex_frame`.
+
+Walls with a `GRID` map on the device are addressed by hold instead of LED:
+`HOLD` takes a hold id, a `col,row` cell, a `col,row:col,row` rectangle or a
+stored region name per color, so clients don't need to know the wiring.
+
+Sparse updates use `SETMANY`, with consecutive same-colored pixels collapsed
+into `first-last` runs.
+
+Routes stored on the device (`ROUTE SAVE/LOAD/LIST`) are versioned with the
+CRC-32 of their frame bytes, so a changed route gets a new version.
+"""
+
+from __future__ import annotations
+
+import binascii
+import struct
+import time
+import zlib
+
+BIN_FRAME_MAGIC = 0xA5
+BIN_FRAME_SEQ_MAGIC = 0xA6
+BIN_FRAME_LZ_MAGIC = 0xA7
+BIN_FRAME_LZ_SEQ_MAGIC = 0xA8
+MAX_PALETTE_COLORS = 16
+
+
+def encode_binary_frame(colors: list[tuple[int, int, int]], seq: int | None = None) -> bytes:
+    body = struct.pack("<H", len(colors)) + bytes(c & 0xFF for rgb in colors for c in rgb)
+    magic = BIN_FRAME_MAGIC
+    if seq is not None:
+        body = struct.pack("<I", seq & 0xFFFFFFFF) + body
+        magic = BIN_FRAME_SEQ_MAGIC
+    crc = binascii.crc_hqx(body, 0xFFFF)
+    return bytes([magic]) + body + struct.pack("<H", crc)
+
+
+def compress_frame(data: bytes) -> bytes:
+    """Greedy LZ for frame bytes, in the firmware's op format:
+
+    0x00-0x7F: op + 1 literal bytes follow
+    0x80-0xBF: (((op & 0x3F) << 8) | next) + 1 zero bytes
+    0xC0-0xFF: copy (op & 0x3F) + 3 bytes from a u16 LE distance back (may overlap)
+    """
+    out = bytearray()
+    literals = bytearray()
+    recent: dict[bytes, list[int]] = {}  # 3-byte key -> latest positions
+
+    def flush() -> None:
+        for start in range(0, len(literals), 128):
+            chunk = literals[start:start + 128]
+            out.append(len(chunk) - 1)
+            out.extend(chunk)
+        literals.clear()
+
+    def remember(pos: int) -> None:
+        positions = recent.setdefault(bytes(data[pos:pos + 3]), [])
+        positions.append(pos)
+        if len(positions) > 8:
+            del positions[0]
+
+    n = len(data)
+    i = 0
+    while i < n:
+        zeros = 0
+        while i + zeros < n and zeros < 0x4000 and data[i + zeros] == 0:
+            zeros += 1
+        if zeros >= 3:
+            flush()
+            out += bytes([0x80 | ((zeros - 1) >> 8), (zeros - 1) & 0xFF])
+            step = zeros
+        else:
+            best_len, best_dist = 0, 0
+            for j in reversed(recent.get(bytes(data[i:i + 3]), [])):
+                if i - j > 0xFFFF:
+                    break
+                length = 0
+                while length < 66 and i + length < n and data[j + length] == data[i + length]:
+                    length += 1
+                if length > best_len:
+                    best_len, best_dist = length, i - j
+            if best_len >= 4:
+                flush()
+                out += bytes([0xC0 | (best_len - 3)]) + struct.pack("<H", best_dist)
+                step = best_len
+            else:
+                literals.append(data[i])
+                step = 1
+        for pos in range(i, min(i + step, n - 2)):
+            remember(pos)
+        i += step
+    flush()
+    return bytes(out)
+
+
+def encode_compressed_frame(colors: list[tuple[int, int, int]], seq: int | None = None) -> bytes:
+    ops = compress_frame(bytes(c & 0xFF for rgb in colors for c in rgb))
+    body = struct.pack("<HH", len(colors), len(ops)) + ops
+    magic = BIN_FRAME_LZ_MAGIC
+    if seq is not None:
+        body = struct.pack("<I", seq & 0xFFFFFFFF) + body
+        magic = BIN_FRAME_LZ_SEQ_MAGIC
+    crc = binascii.crc_hqx(body, 0xFFFF)
+    return bytes([magic]) + body + struct.pack("<H", crc)
+
+
+def seq_prefix(seq: int | None) -> str:
+    return "" if seq is None else f"@{seq & 0xFFFFFFFF} "
+
+
+def parse_seq(resp: str) -> int | None:
+    """Parse `OK SEQ <n>`; None if the reply isn't one."""
+    parts = resp.split()
+    if len(parts) != 3 or parts[:2] != ["OK", "SEQ"]:
+        return None
+    try:
+        return int(parts[2])
+    except ValueError:
+        return None
+
+
+def clock_ms() -> int:
+    """Host side of the shared presentation clock (see `TIME`/`AT`)."""
+    return int(time.monotonic() * 1000) & 0xFFFFFFFF
+
+
+def parse_time(resp: str) -> int | None:
+    """Parse `OK TIME <ms>`; None if the reply isn't one."""
+    parts = resp.split()
+    if len(parts) != 3 or parts[:2] != ["OK", "TIME"]:
+        return None
+    try:
+        return int(parts[2])
+    except ValueError:
+        return None
+
+
+def clock_adjustment(t0: int, device_ms: int, t1: int) -> int:
+    """`TIME ADJ` delta that moves a clock which read `device_ms` between host
+    times t0 and t1 onto the host clock, assuming a symmetric round trip."""
+    delta = (t0 + ((t1 - t0) & 0xFFFFFFFF) // 2 - device_ms) & 0xFFFFFFFF
+    return delta - (1 << 32) if delta >= 1 << 31 else delta
+
+
+def encode_hex_frame(colors: list[tuple[int, int, int]]) -> str:
+    return "".join(f"{int(r) & 0xFF:02X}{int(g) & 0xFF:02X}{int(b) & 0xFF:02X}" for r, g, b in colors)
+
+
+def decode_hex_frame(hex_str: str) -> list[tuple[int, int, int]]:
+    """Inverse of `encode_hex_frame` (the frame in `/events` state events)."""
+    raw = bytes.fromhex(hex_str)
+    return [(raw[i], raw[i + 1], raw[i + 2]) for i in range(0, len(raw) - 2, 3)]
+
+
+def frame_palette(
+    colors: list[tuple[int, int, int]],
+    current: list[tuple[int, int, int]] | None = None,
+) -> list[tuple[int, int, int]] | None:
+    """Palette for an indexed frame: `current` if it already covers `colors`,
+    else their distinct colors in sorted order (so routes sharing a color set
+    share a palette); None if there are more than MAX_PALETTE_COLORS."""
+    distinct = set(colors)
+    if current is not None and distinct <= set(current):
+        return current
+    if len(distinct) > MAX_PALETTE_COLORS:
+        return None
+    return sorted(distinct)
+
+
+def palette_command(palette: list[tuple[int, int, int]]) -> str:
+    return "PALETTE " + " ".join(encode_hex_frame([c]) for c in palette)
+
+
+def encode_indexed_frame(colors: list[tuple[int, int, int]], palette: list[tuple[int, int, int]]) -> str:
+    """`PFRAME` arguments (`<bits> <hex>`) for `colors`, all of which must be in `palette`."""
+    bits = 1 if len(palette) <= 2 else 2 if len(palette) <= 4 else 4
+    index = {color: i for i, color in enumerate(palette)}
+    per_byte = 8 // bits
+    packed = bytearray((len(colors) + per_byte - 1) // per_byte)
+    for i, color in enumerate(colors):
+        packed[i // per_byte] |= index[color] << (8 - bits - (i % per_byte) * bits)
+    return f"{bits} {packed.hex().upper()}"
+
+
+TIMELINE_EASES = ("LINEAR", "EASE", "STEP")
+MAX_KEYFRAMES = 8
+
+
+def timeline_commands(keyframes: list[tuple[int, list[tuple[int, int, int]], str]], loop: bool = False) -> list[str]:
+    """Commands that upload and play `keyframes`, given as `(ms, colors, ease)`
+    with ms strictly increasing from the start of playback."""
+    if not 0 < len(keyframes) <= MAX_KEYFRAMES:
+        raise ValueError(f"a timeline has 1 to {MAX_KEYFRAMES} keyframes")
+    cmds = ["TIMELINE CLEAR"]
+    for ms, colors, ease in keyframes:
+        if ease.upper() not in TIMELINE_EASES:
+            raise ValueError(f"unknown ease {ease!r}")
+        cmds.append(f"TIMELINE KEY {int(ms)} {ease.upper()} {encode_hex_frame(colors)}")
+    cmds.append("TIMELINE PLAY LOOP" if loop else "TIMELINE PLAY")
+    return cmds
+
+
+def frame_version(colors: list[tuple[int, int, int]]) -> int:
+    return zlib.crc32(bytes(c & 0xFF for rgb in colors for c in rgb))
+
+
+def parse_route_list(resp: str) -> dict[int, int] | None:
+    """Parse `OK ROUTES <id>:<version hex> ...`; None if the reply isn't one."""
+    parts = resp.split()
+    if parts[:2] != ["OK", "ROUTES"]:
+        return None
+    routes: dict[int, int] = {}
+    for tok in parts[2:]:
+        rid, _, ver = tok.partition(":")
+        routes[int(rid)] = int(ver, 16)
+    return routes
+
+
+def setmany_commands(
+    colors: list[tuple[int, int, int]],
+    indices: list[int],
+    max_chars: int = 1024,
+    seq: int | None = None,
+) -> list[str]:
+    """Build `SETMANY` commands covering `indices`, each at most `max_chars` long."""
+    runs: list[tuple[int, int, tuple[int, int, int]]] = []
+    for i in sorted(indices):
+        color = colors[i]
+        if runs and runs[-1][1] == i - 1 and runs[-1][2] == color:
+            runs[-1] = (runs[-1][0], i, color)
+        else:
+            runs.append((i, i, color))
+
+    verb = seq_prefix(seq) + "SETMANY"
+    commands: list[str] = []
+    current = verb
+    for first, last, (r, g, b) in runs:
+        target = str(first) if first == last else f"{first}-{last}"
+        part = f" {target} {int(r)} {int(g)} {int(b)}"
+        if len(current) + len(part) > max_chars and current != verb:
+            commands.append(current)
+            current = verb
+        current += part
+    if current != verb:
+        commands.append(current)
+    return commands
+
+
+def hold_target(target) -> str:
+    """`HOLD` spelling of a hold id, region name, `(col, row)` cell or
+    `((col, row), (col, row))` rectangle."""
+    if isinstance(target, str):
+        return target
+    if isinstance(target, int):
+        return str(target)
+    if isinstance(target[0], int):
+        return f"{int(target[0])},{int(target[1])}"
+    (c0, r0), (c1, r1) = target
+    return f"{int(c0)},{int(r0)}:{int(c1)},{int(r1)}"
+
+
+def hold_commands(
+    runs: list[tuple[object, tuple[int, int, int]]],
+    max_chars: int = 1024,
+    max_runs: int = 64,
+) -> list[str]:
+    """Build `HOLD` commands lighting each `(target, color)` run, each at most
+    `max_chars` long and `max_runs` runs; see `hold_target` for the targets."""
+    commands: list[str] = []
+    current = "HOLD"
+    count = 0
+    for target, (r, g, b) in runs:
+        part = f" {hold_target(target)} {int(r)} {int(g)} {int(b)}"
+        if (len(current) + len(part) > max_chars or count == max_runs) and current != "HOLD":
+            commands.append(current)
+            current = "HOLD"
+            count = 0
+        current += part
+        count += 1
+    if current != "HOLD":
+        commands.append(current)
+    return commands
@@ -115,6 +115,11 @@ class RouteStore:
                 "frame": frame,
             }
 
+    def route_id(self, level: int, slot: int) -> int:
+        """Stable numeric id for a level/slot, used as the firmware's ROUTE slot."""
+        self._validate_level_slot(level, slot)
+        return ROUTE_LEVELS.index(level) * ROUTES_PER_LEVEL + (slot - 1)
+
     def save_route(self, level: int, slot: int, name: str, frame: list[list[int]]) -> dict[str, Any]:
         self._validate_level_slot(level, slot)
         clean_name = self._normalize_name(name, "")
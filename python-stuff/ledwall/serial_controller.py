@@ -5,6 +5,10 @@ This module:
 - Finds a likely ESP32 serial port (or uses a user-provided one)
 - Opens the port at 115200 baud
 - Sends ASCII line commands (e.g. "SET 0 255 0 0") and waits for "OK"/"ERR"
+- Pipelines batches of commands tagged with `#<id>` when the firmware supports it
+- Optionally raises the link rate with `BAUD` after connecting
+- Sends full frames as binary packets (see `frame_codec.py`) when the firmware supports it
+- Sends few-color frames (routes) as palette indices with `PALETTE`/`PFRAME`, which is smaller still
 
 It’s the single place that understands the serial protocol details; higher layers
 (FastAPI, CLI tools) call these methods instead of dealing with raw bytes.
@@ -18,9 +22,30 @@ import serial
 from serial.tools import list_ports
 import sys
 
+from .frame_codec import (
+    clock_adjustment,
+    clock_ms,
+    encode_binary_frame,
+    encode_compressed_frame,
+    encode_hex_frame,
+    encode_indexed_frame,
+    frame_palette,
+    frame_version,
+    hold_commands,
+    palette_command,
+    parse_route_list,
+    parse_seq,
+    parse_time,
+    seq_prefix,
+    setmany_commands,
+    timeline_commands,
+)
+
 
 BAUD = 115200
 _FRAME_FAST_FALLBACK_THRESHOLD = 16
+# Unacknowledged bytes allowed in flight; well inside the firmware's 4 KiB RX buffer.
+_PIPELINE_WINDOW_BYTES = 2048
 
 
 class SerialNotConnectedError(RuntimeError):
@@ -78,14 +103,26 @@ def pick_port(preferred: str | None) -> str:
 class LedSerialController:
     """Thread-safe serial client for the firmware’s line-based protocol."""
 
-    def __init__(self, port: str | None = None, baud: int = BAUD):
+    def __init__(self, port: str | None = None, baud: int = BAUD, link_baud: int | None = None):
         self._preferred_port = port
         self._baud = baud
+        self._link_baud = link_baud
         self._ser: serial.Serial | None = None
         self._lock = threading.Lock()
         self._last_non_ok: str | None = None
         self._frame_cache: list[tuple[int, int, int]] | None = None
+        self._supports_setmany = True
+        self._supports_routes = True
+        self._device_routes: dict[int, int] | None = None
+        self._supports_seq = True
+        self._seq: int | None = None
+        self._supports_pipeline: bool | None = None
+        self._next_cmd_id = 0
         self._supports_frame_cmd = True
+        self._supports_binary_frame = True
+        self._supports_compressed_frame: bool | None = None
+        self._supports_palette = True
+        self._device_palette: list[tuple[int, int, int]] | None = None
 
     @property
     def port(self) -> str | None:
@@ -99,9 +136,6 @@ class LedSerialController:
         ser.dtr = False
         ser.rts = False
         time.sleep(0.1)
-
-        # Opening serial often resets the MCU; give it time to boot.
-        time.sleep(2.5)
         ser.reset_input_buffer()
 
         with self._lock:
@@ -113,16 +147,32 @@ class LedSerialController:
             self._ser = ser
             self._frame_cache = None
             self._supports_frame_cmd = True
-
-        # Best-effort handshake.
-        self._wait_for_ready(timeout_s=2.0)
-        try:
-            self.ping()
-        except Exception:
-            pass
+            self._supports_binary_frame = True
+            self._supports_compressed_frame = None
+            self._supports_palette = True
+            self._device_palette = None
+            self._supports_setmany = True
+            self._supports_routes = True
+            self._device_routes = None
+            self._supports_seq = True
+            self._seq = None
+            self._supports_pipeline = None
+
+        # Opening serial often resets the MCU. The firmware answers within
+        # milliseconds of booting (Wi-Fi connects in the background), so poll
+        # instead of sleeping through a fixed boot delay. Best effort.
+        self._wait_for_ready(timeout_s=3.0)
+        if self._link_baud and self._link_baud != self._baud:
+            self._switch_baud(self._link_baud)
         return chosen
 
     def close(self) -> None:
+        # Leave the firmware at the default rate for whoever opens the port next.
+        if self._ser and self._ser.baudrate != self._baud:
+            try:
+                self._switch_baud(self._baud)
+            except Exception:
+                pass
         with self._lock:
             if not self._ser:
                 return
@@ -130,6 +180,16 @@ class LedSerialController:
             self._ser = None
             self._frame_cache = None
             self._supports_frame_cmd = True
+            self._supports_binary_frame = True
+            self._supports_compressed_frame = None
+            self._supports_palette = True
+            self._device_palette = None
+            self._supports_setmany = True
+            self._supports_routes = True
+            self._device_routes = None
+            self._supports_seq = True
+            self._seq = None
+            self._supports_pipeline = None
 
     def _require(self) -> serial.Serial:
         if not self._ser:
@@ -145,20 +205,20 @@ class LedSerialController:
         self._frame_cache[index] = (int(r), int(g), int(b))
 
     def _wait_for_ready(self, timeout_s: float) -> bool:
-        ser = self._ser
-        if not ser:
-            return False
         t0 = time.time()
         while time.time() - t0 < timeout_s:
-            line = ser.readline().decode("utf-8", errors="replace").strip()
-            if not line:
-                continue
-            if line == "READY":
-                return True
+            try:
+                if self.send("PING", timeout_s=0.3) == "OK":
+                    return True
+            except Exception:
+                pass
         return False
 
     def send(self, cmd: str, timeout_s: float = 6.0) -> str:
         cmd = cmd.strip()
+        return self._transact((cmd + "\r\n").encode("utf-8"), repr(cmd), timeout_s)
+
+    def _transact(self, data: bytes, label: str, timeout_s: float) -> str:
         with self._lock:
             ser = self._require()
             # Drop boot noise / partial lines before sending.
@@ -166,7 +226,7 @@ class LedSerialController:
                 ser.reset_input_buffer()
             except Exception:
                 pass
-            ser.write((cmd + "\r\n").encode("utf-8"))
+            ser.write(data)
             ser.flush()
 
             t0 = time.time()
@@ -199,10 +259,135 @@ class LedSerialController:
             if raw_tail:
                 detail.append(f"raw_tail={raw_tail!r}")
             extra = (" (" + ", ".join(detail) + ")") if detail else ""
-            raise TimeoutError(f"No OK/ERR response for {cmd!r}{extra}")
+            raise TimeoutError(f"No OK/ERR response for {label}{extra}")
+
+    def _next_seq(self) -> int | None:
+        """Sequence number for the next update, continuing from the device's; None if unsupported."""
+        if self._supports_seq and self._seq is None:
+            self._seq = parse_seq(self.send("SEQ"))
+            if self._seq is None:
+                self._supports_seq = False
+        if self._seq is None:
+            return None
+        self._seq = (self._seq + 1) & 0xFFFFFFFF
+        return self._seq
+
+    def _applied(self, resp: str, desired: list[tuple[int, int, int]]) -> None:
+        # A stale update was dropped because another writer's newer frame is live.
+        self._frame_cache = None if resp == "OK STALE" else list(desired)
+
+    def _switch_baud(self, baud: int) -> bool:
+        try:
+            resp = self.send(f"BAUD {int(baud)}", timeout_s=1.0)
+        except Exception:
+            return False
+        if not resp.startswith("OK"):
+            return False
+        with self._lock:
+            ser = self._require()
+            time.sleep(0.05)  # The firmware switches once its reply has gone out.
+            ser.baudrate = int(baud)
+            ser.reset_input_buffer()
+        return True
+
+    def send_batch(self, cmds: list[str], timeout_s: float = 6.0) -> list[str]:
+        """Send commands back to back without waiting for each reply; replies in order."""
+        if self._supports_pipeline is None:
+            try:
+                self._supports_pipeline = self.send("#0 PING", timeout_s=1.0) == "#0 OK"
+            except TimeoutError:
+                self._supports_pipeline = False
+        if not self._supports_pipeline:
+            return [self.send(cmd, timeout_s=timeout_s) for cmd in cmds]
 
-    def _frame_hex(self, colors: list[tuple[int, int, int]]) -> str:
-        return "".join(f"{r:02X}{g:02X}{b:02X}" for (r, g, b) in colors)
+        with self._lock:
+            ser = self._require()
+            try:
+                ser.reset_input_buffer()
+            except Exception:
+                pass
+
+            first_id = self._next_cmd_id
+            self._next_cmd_id = (first_id + len(cmds)) % 1_000_000
+            packets = [
+                f"#{(first_id + i) % 1_000_000} {cmd.strip()}\r\n".encode("utf-8") for i, cmd in enumerate(cmds)
+            ]
+            replies: list[str] = []
+            sent = 0
+            in_flight = 0
+            t0 = time.time()
+            while len(replies) < len(packets):
+                while sent < len(packets) and (sent == len(replies) or in_flight + len(packets[sent]) <= _PIPELINE_WINDOW_BYTES):
+                    ser.write(packets[sent])
+                    in_flight += len(packets[sent])
+                    sent += 1
+                ser.flush()
+
+                if time.time() - t0 > timeout_s:
+                    raise TimeoutError(f"No reply for {cmds[len(replies)]!r} (pipelined)")
+                line = ser.readline().decode("utf-8", errors="replace").strip()
+                if not line:
+                    continue
+                tag, _, resp = line.partition(" ")
+                if tag != f"#{(first_id + len(replies)) % 1_000_000}":
+                    self._last_non_ok = line  # Log noise or a reply from an earlier batch
+                    continue
+                replies.append(resp)
+                in_flight -= len(packets[len(replies) - 1])
+                t0 = time.time()
+            return replies
+
+    def _compressed_frames(self) -> bool:
+        """Whether the firmware takes compressed binary frames (INFO lists `LZ 1`)."""
+        if self._supports_compressed_frame is None:
+            try:
+                self._supports_compressed_frame = " LZ 1" in self.send("INFO", timeout_s=1.0)
+            except Exception:
+                return False  # Ask again next frame
+        return self._supports_compressed_frame
+
+    def _send_indexed_frame(self, desired: list[tuple[int, int, int]]) -> str | None:
+        """Send `desired` as PFRAME, uploading its palette first if needed; None
+        if it has too many colors, wouldn't be smaller, or isn't supported."""
+        palette = frame_palette(desired, self._device_palette)
+        if palette is None:
+            return None
+        pframe = "PFRAME " + encode_indexed_frame(desired, palette)
+        if len(pframe) >= (len(desired) * 3 + 5 if self._supports_binary_frame else len(desired) * 6):
+            return None
+        cmds = [f"{seq_prefix(self._next_seq())}{pframe}"]
+        if palette != self._device_palette:
+            cmds.insert(0, palette_command(palette))
+        resp = "OK"
+        try:
+            for resp in self.send_batch(cmds):
+                if not resp.startswith("OK"):
+                    raise RuntimeError(resp)
+        except Exception as e:
+            # Older firmware, or the device lost its palette (reboot, another host).
+            self._device_palette = None
+            if "unknown command" in str(e):
+                self._supports_palette = False
+            return None
+        self._device_palette = palette
+        return resp
+
+    def _send_setmany(self, desired: list[tuple[int, int, int]], indices: list[int]) -> str | None:
+        """Apply changed pixels as batched SETMANY runs; None if unsupported."""
+        resp = "OK"
+        try:
+            for resp in self.send_batch(setmany_commands(desired, indices, seq=self._next_seq())):
+                if resp == "OK STALE":
+                    break
+                if not resp.startswith("OK"):
+                    if "unknown command" in resp:
+                        self._supports_setmany = False
+                        return None
+                    raise RuntimeError(resp)
+        except Exception:
+            self._frame_cache = None
+            raise
+        return resp
 
     def ping(self) -> None:
         resp = self.send("PING")
@@ -235,6 +420,32 @@ class LedSerialController:
             return DeviceInfo(raw=resp)
         return info
 
+    def sync_clock(self, samples: int = 5) -> int:
+        """Align the device's TIME clock with `clock_ms()` from the fastest of
+        `samples` round trips; returns that round trip in ms."""
+        best: tuple[int, int] | None = None
+        for _ in range(samples):
+            t0 = clock_ms()
+            resp = self.send("TIME")
+            t1 = clock_ms()
+            device_ms = parse_time(resp)
+            if device_ms is None:
+                raise RuntimeError(resp)
+            rtt = (t1 - t0) & 0xFFFFFFFF
+            if best is None or rtt < best[0]:
+                best = (rtt, clock_adjustment(t0, device_ms, t1))
+        resp = self.send(f"TIME ADJ {best[1]}")
+        if parse_time(resp) is None:
+            raise RuntimeError(resp)
+        return best[0]
+
+    def present_at(self, at_ms: int) -> None:
+        """Hold presentation until `clock_ms()` reaches `at_ms` (after
+        `sync_clock`); updates sent meanwhile show together at that moment."""
+        resp = self.send(f"AT {at_ms & 0xFFFFFFFF}")
+        if not resp.startswith("OK"):
+            raise RuntimeError(resp)
+
     def brightness(self, value: int) -> None:
         resp = self.send(f"BRIGHT {int(value)}")
         if not resp.startswith("OK"):
@@ -267,6 +478,51 @@ class LedSerialController:
         if not resp.startswith("OK"):
             raise RuntimeError(resp)
 
+    def light_holds(self, runs: list[tuple[object, tuple[int, int, int]]]) -> None:
+        """Light `(target, color)` runs through the device's hold map (`GRID`):
+        hold ids, `(col, row)` cells, `((col, row), (col, row))` rectangles or
+        region names. Other pixels keep their colors."""
+        for resp in self.send_batch(hold_commands(runs)):
+            if not resp.startswith("OK"):
+                raise RuntimeError(resp)
+        # The device did the mapping; the cache doesn't know which LEDs changed.
+        self._frame_cache = None
+
+    def play_timeline(self, keyframes: list[tuple[int, list[tuple[int, int, int]], str]], loop: bool = False) -> None:
+        """Upload `(ms, colors, ease)` keyframes and play them on the device."""
+        for resp in self.send_batch(timeline_commands(keyframes, loop)):
+            if not resp.startswith("OK"):
+                raise RuntimeError(resp)
+        # The device animates on its own from here.
+        self._frame_cache = None
+
+    def apply_route(self, route_id: int, colors: list[tuple[int, int, int]]) -> None:
+        """Show a route from the device's route table, uploading it first if stale."""
+        desired = [(int(r), int(g), int(b)) for (r, g, b) in colors]
+        if self._supports_routes:
+            try:
+                if self._device_routes is None:
+                    self._device_routes = parse_route_list(self.send("ROUTE LIST"))
+                if self._device_routes is None:
+                    self._supports_routes = False
+                else:
+                    version = frame_version(desired)
+                    if self._device_routes.get(route_id) != version:
+                        cmd = f"ROUTE SAVE {int(route_id)} {version:08x} {encode_hex_frame(desired)}"
+                        resp = self.send(cmd)
+                        if not resp.startswith("OK"):
+                            raise RuntimeError(resp)
+                        self._device_routes[route_id] = version
+                    resp = self.send(f"{seq_prefix(self._next_seq())}ROUTE LOAD {int(route_id)}")
+                    if not resp.startswith("OK"):
+                        raise RuntimeError(resp)
+                    self._applied(resp, desired)
+                    return
+            except Exception:
+                self._device_routes = None  # Re-read the table next time
+
+        self.set_frame(desired)
+
     def set_frame(self, colors: list[tuple[int, int, int]], force: bool = False) -> None:
         desired = [(int(r), int(g), int(b)) for (r, g, b) in colors]
         if not force and self._frame_cache is not None and len(self._frame_cache) == len(desired):
@@ -277,22 +533,66 @@ class LedSerialController:
         if not changed_indices:
             return
 
+        if self._supports_palette and len(changed_indices) >= _FRAME_FAST_FALLBACK_THRESHOLD:
+            resp = self._send_indexed_frame(desired)
+            if resp is not None:
+                self._applied(resp, desired)
+                return
+
+        binary_unanswered = False
+        if self._supports_binary_frame and len(changed_indices) >= _FRAME_FAST_FALLBACK_THRESHOLD:
+            seq = self._next_seq()
+            packet = encode_binary_frame(desired, seq=seq)
+            if self._compressed_frames():
+                compressed = encode_compressed_frame(desired, seq=seq)
+                if len(compressed) < len(packet):
+                    packet = compressed
+            try:
+                resp = self._transact(packet, "binary frame", timeout_s=2.0)
+            except TimeoutError:
+                resp = None  # The text FRAME below replaces it
+                binary_unanswered = True
+            except Exception:
+                self._frame_cache = None
+                raise
+            if resp is not None:
+                if resp.startswith("OK"):
+                    self._applied(resp, desired)
+                    return
+                if "unknown command" not in resp and "usage" not in resp:
+                    # A frame the firmware understood but dropped (queue full, bad crc).
+                    self._frame_cache = None
+                    raise RuntimeError(resp)
+                # Older firmware treats the packet as a garbage line; fall back to text FRAME.
+                self._supports_binary_frame = False
+
         if self._supports_frame_cmd and len(changed_indices) >= _FRAME_FAST_FALLBACK_THRESHOLD:
             try:
-                resp = self.send(f"FRAME {self._frame_hex(desired)}", timeout_s=8.0)
+                cmd = f"{seq_prefix(self._next_seq())}FRAME {encode_hex_frame(desired)}"
+                resp = self.send(cmd, timeout_s=8.0)
                 if not resp.startswith("OK"):
                     raise RuntimeError(resp)
-                self._frame_cache = list(desired)
+                if binary_unanswered:
+                    # The device answers text but not packets: older firmware
+                    # buffering the packet as a line that never ends.
+                    self._supports_binary_frame = False
+                self._applied(resp, desired)
                 return
             except Exception:
                 # Older firmware may not support FRAME; permanently fall back after first failure.
                 self._supports_frame_cmd = False
 
+        if self._supports_setmany:
+            resp = self._send_setmany(desired, changed_indices)
+            if resp is not None:
+                self._applied(resp, desired)
+                return
+
         try:
-            for i in changed_indices:
-                r, g, b = desired[i]
-                self.set_pixel(i, r, g, b, show=False)
-            self.show()
+            cmds = [f"SETN {i} {desired[i][0]} {desired[i][1]} {desired[i][2]}" for i in changed_indices]
+            for resp in self.send_batch(cmds + ["SHOW"]):
+                if not resp.startswith("OK"):
+                    raise RuntimeError(resp)
         except Exception:
             self._frame_cache = None
             raise
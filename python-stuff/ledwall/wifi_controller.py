@@ -3,17 +3,50 @@ Wi-Fi transport + command wrapper for the ESP32 LED strip firmware.
 
 Uses the same line-based command protocol as serial transport, but sends
 commands to the ESP32 over HTTP (`/cmd?q=<COMMAND>`).
+
+Full frames go over a persistent raw TCP stream (`STREAM_PORT`) as binary
+packets when the firmware offers it, falling back to `PFRAME` palette indices
+over `/cmd` for few-color frames (routes) and then to `POST /frame`. Firmware
+that lists `LZ 1` in INFO gets the packets compressed when that is smaller, and
+takes them as `POST /frame` bodies instead of hex.
 """
 
 from __future__ import annotations
 
+import json
+import socket
 import threading
 import time
+from collections.abc import Iterator
 from dataclasses import dataclass
 from urllib.error import HTTPError, URLError
 from urllib.parse import quote_plus
 from urllib.request import Request, urlopen
 
+from .frame_codec import (
+    clock_adjustment,
+    clock_ms,
+    decode_hex_frame,
+    encode_binary_frame,
+    encode_compressed_frame,
+    encode_hex_frame,
+    encode_indexed_frame,
+    frame_palette,
+    frame_version,
+    hold_commands,
+    palette_command,
+    parse_route_list,
+    parse_seq,
+    parse_time,
+    seq_prefix,
+    setmany_commands,
+    timeline_commands,
+)
+
+STREAM_PORT = 7777
+_MAX_BATCH_CHARS = 8192  # MAX_BATCH_CHARS in the firmware
+_MAX_BATCH_COMMANDS = 32  # MAX_BATCH_COMMANDS in the firmware
+
 
 class WifiNotConnectedError(RuntimeError):
     pass
@@ -26,6 +59,16 @@ class DeviceInfo:
     raw: str | None = None
 
 
+@dataclass(frozen=True)
+class WallState:
+    """One `state` event from the firmware's `/events` stream."""
+
+    version: int
+    seq: int | None
+    brightness: int
+    colors: list[tuple[int, int, int]]
+
+
 class LedWifiController:
     """Thread-safe Wi-Fi client for the firmware's line-based protocol."""
 
@@ -42,6 +85,18 @@ class LedWifiController:
         self._retry_delay_s = max(0.0, float(retry_delay_s))
         self._lock = threading.Lock()
         self._frame_cache: list[tuple[int, int, int]] | None = None
+        self._supports_setmany = True
+        self._supports_routes = True
+        self._device_routes: dict[int, int] | None = None
+        self._supports_seq = True
+        self._seq: int | None = None
+        self._stream: socket.socket | None = None
+        self._stream_buf = b""
+        self._supports_stream = True
+        self._supports_compressed_frame: bool | None = None
+        self._supports_palette = True
+        self._device_palette: list[tuple[int, int, int]] | None = None
+        self._supports_batch = True
 
     @property
     def port(self) -> str | None:
@@ -55,6 +110,17 @@ class LedWifiController:
         prev = self._host
         self._host = chosen
         self._frame_cache = None
+        self._close_stream()
+        self._supports_stream = True
+        self._supports_compressed_frame = None
+        self._supports_palette = True
+        self._device_palette = None
+        self._supports_batch = True
+        self._supports_setmany = True
+        self._supports_routes = True
+        self._device_routes = None
+        self._supports_seq = True
+        self._seq = None
         try:
             self.ping()
         except Exception:
@@ -66,6 +132,16 @@ class LedWifiController:
     def close(self) -> None:
         self._host = ""
         self._frame_cache = None
+        self._close_stream()
+
+    def _close_stream(self) -> None:
+        if self._stream is not None:
+            try:
+                self._stream.close()
+            except OSError:
+                pass
+        self._stream = None
+        self._stream_buf = b""
 
     def _require(self) -> str:
         if not self._host:
@@ -120,15 +196,93 @@ class LedWifiController:
             raise last_error
         raise RuntimeError(f"Failed to send command {cmd!r}")
 
-    def _send_frame_fast(self, colors: list[tuple[int, int, int]]) -> str:
-        payload = "".join(f"{int(r) & 0xFF:02X}{int(g) & 0xFF:02X}{int(b) & 0xFF:02X}" for r, g, b in colors)
-
-        req = Request(
-            self._frame_url(),
-            data=payload.encode("ascii"),
-            method="POST",
-            headers={"Content-Type": "text/plain"},
-        )
+    def send_batch(self, cmds: list[str]) -> list[str]:
+        """Run commands in one `POST /batch` round trip; replies in order.
+
+        The firmware applies a batch as one transaction with a single show:
+        the first ERR rolls the frame back and the rest reply `ERR skipped`.
+        Lists longer than the firmware's 32-command, 8192-char body go out as
+        several batches, each its own transaction. Firmware without the endpoint gets
+        one `/cmd` request per command."""
+        cmds = [cmd.strip() for cmd in cmds if cmd.strip()]
+        replies: list[str] = []
+        chunk: list[str] = []
+        size = 0
+        for cmd in cmds + [None]:
+            if cmd is None or (
+                chunk and (size + len(cmd) + 1 > _MAX_BATCH_CHARS or len(chunk) == _MAX_BATCH_COMMANDS)
+            ):
+                if not self._supports_batch:
+                    replies += [self.send(c) for c in chunk]
+                elif replies and not replies[-1].startswith("OK"):
+                    replies += ["ERR skipped"] * len(chunk)
+                else:
+                    replies += self._post_batch(chunk)
+                chunk, size = [], 0
+            if cmd is not None:
+                chunk.append(cmd)
+                size += len(cmd) + 1
+        return replies
+
+    def _post_batch(self, cmds: list[str]) -> list[str]:
+        host = self._require()
+        body = "\n".join(cmds).encode("utf-8")
+        req = Request(f"http://{host}/batch", data=body, method="POST", headers={"Content-Type": "text/plain"})
+        with self._lock:
+            try:
+                with urlopen(req, timeout=self._timeout_s) as response:
+                    payload = response.read().decode("utf-8", errors="replace")
+            except HTTPError as e:
+                if e.code == 404:
+                    payload = None
+                else:
+                    payload = e.read().decode("utf-8", errors="replace")
+                    if not payload.strip():
+                        raise RuntimeError(f"HTTP {e.code} for batch") from e
+            except (URLError, TimeoutError) as e:
+                raise RuntimeError(f"Failed to reach ESP32 at {self._host}: {getattr(e, 'reason', e)}") from e
+        if payload is None:
+            self._supports_batch = False
+            return [self.send(cmd) for cmd in cmds]
+        replies = [line.strip() for line in payload.splitlines() if line.strip()]
+        if len(replies) != len(cmds):
+            raise RuntimeError(f"Unexpected batch reply: {payload.strip()!r}")
+        return replies
+
+    def _compressed_frames(self) -> bool:
+        """Whether the firmware takes compressed binary frames (INFO lists `LZ 1`)."""
+        if self._supports_compressed_frame is None:
+            try:
+                self._supports_compressed_frame = " LZ 1" in self.send("INFO")
+            except Exception:
+                return False  # Ask again next frame
+        return self._supports_compressed_frame
+
+    def _frame_packet(self, colors: list[tuple[int, int, int]], seq: int | None) -> bytes:
+        packet = encode_binary_frame(colors, seq=seq)
+        if self._compressed_frames():
+            compressed = encode_compressed_frame(colors, seq=seq)
+            if len(compressed) < len(packet):
+                packet = compressed
+        return packet
+
+    def _send_frame_fast(self, colors: list[tuple[int, int, int]], seq: int | None = None) -> str:
+        if self._compressed_frames():
+            # A binary packet carries its own seq.
+            req = Request(
+                self._frame_url(),
+                data=self._frame_packet(colors, seq),
+                method="POST",
+                headers={"Content-Type": "application/octet-stream"},
+            )
+        else:
+            url = self._frame_url() if seq is None else f"{self._frame_url()}?seq={seq}"
+            req = Request(
+                url,
+                data=encode_hex_frame(colors).encode("ascii"),
+                method="POST",
+                headers={"Content-Type": "text/plain"},
+            )
         # Use a shorter timeout for the bulk frame path: it's either fast (local LAN)
         # or it's not going to work — don't block the fallback for 3+ seconds.
         fast_timeout = min(self._timeout_s, 1.5)
@@ -151,6 +305,93 @@ class LedWifiController:
             raise last_error
         raise RuntimeError("Failed to send frame")
 
+    def _open_stream(self) -> socket.socket:
+        host = self._require()
+        try:
+            sock = socket.create_connection((host, STREAM_PORT), timeout=min(self._timeout_s, 1.5))
+        except ConnectionRefusedError:
+            # Older firmware has no stream port; stick to HTTP until reconnect.
+            # Other errors (timeouts) just send this frame over HTTP.
+            self._supports_stream = False
+            raise
+        sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        self._stream = sock
+        self._stream_buf = b""
+        return sock
+
+    def _send_frame_stream(self, colors: list[tuple[int, int, int]], seq: int | None = None) -> str:
+        packet = self._frame_packet(colors, seq)
+        with self._lock:
+            try:
+                sock = self._stream or self._open_stream()
+                sock.sendall(packet)
+                while b"\n" not in self._stream_buf:
+                    chunk = sock.recv(256)
+                    if not chunk:
+                        raise RuntimeError("Frame stream closed by ESP32")
+                    self._stream_buf += chunk
+            except Exception:
+                self._close_stream()
+                raise
+            line, _, self._stream_buf = self._stream_buf.partition(b"\n")
+            return line.decode("utf-8", errors="replace").strip()
+
+    def _next_seq(self) -> int | None:
+        """Sequence number for the next update, continuing from the device's; None if unsupported."""
+        if self._supports_seq and self._seq is None:
+            self._seq = parse_seq(self.send("SEQ"))
+            if self._seq is None:
+                self._supports_seq = False
+        if self._seq is None:
+            return None
+        self._seq = (self._seq + 1) & 0xFFFFFFFF
+        return self._seq
+
+    def _applied(self, resp: str, desired: list[tuple[int, int, int]]) -> None:
+        # A stale update was dropped because another writer's newer frame is live.
+        self._frame_cache = None if resp == "OK STALE" else list(desired)
+
+    def _send_indexed_frame(self, desired: list[tuple[int, int, int]]) -> str | None:
+        """Send `desired` as PFRAME over /cmd, uploading its palette first if
+        needed; None if it has too many colors or isn't supported."""
+        palette = frame_palette(desired, self._device_palette)
+        if palette is None:
+            return None
+        try:
+            if palette != self._device_palette:
+                resp = self.send(palette_command(palette))
+                if not resp.startswith("OK"):
+                    raise RuntimeError(resp)
+                self._device_palette = palette
+            resp = self.send(f"{seq_prefix(self._next_seq())}PFRAME {encode_indexed_frame(desired, palette)}")
+            if not resp.startswith("OK"):
+                raise RuntimeError(resp)
+        except Exception as e:
+            # Older firmware, or the device lost its palette (reboot, another host).
+            self._device_palette = None
+            if "unknown command" in str(e):
+                self._supports_palette = False
+            return None
+        return resp
+
+    def _send_setmany(self, desired: list[tuple[int, int, int]], indices: list[int]) -> str | None:
+        """Apply changed pixels as batched SETMANY runs; None if unsupported."""
+        resp = "OK"
+        try:
+            for cmd in setmany_commands(desired, indices, seq=self._next_seq()):
+                resp = self.send(cmd)
+                if resp == "OK STALE":
+                    break
+                if not resp.startswith("OK"):
+                    if "unknown command" in resp:
+                        self._supports_setmany = False
+                        return None
+                    raise RuntimeError(resp)
+        except Exception:
+            self._frame_cache = None
+            raise
+        return resp
+
     def ping(self) -> None:
         resp = self.send("PING")
         if not resp.startswith("OK"):
@@ -181,6 +422,61 @@ class LedWifiController:
             return DeviceInfo(raw=resp)
         return info
 
+    def sync_clock(self, samples: int = 5) -> int:
+        """Align the device's TIME clock with `clock_ms()` from the fastest of
+        `samples` round trips; returns that round trip in ms."""
+        best: tuple[int, int] | None = None
+        for _ in range(samples):
+            t0 = clock_ms()
+            resp = self.send("TIME")
+            t1 = clock_ms()
+            device_ms = parse_time(resp)
+            if device_ms is None:
+                raise RuntimeError(resp)
+            rtt = (t1 - t0) & 0xFFFFFFFF
+            if best is None or rtt < best[0]:
+                best = (rtt, clock_adjustment(t0, device_ms, t1))
+        resp = self.send(f"TIME ADJ {best[1]}")
+        if parse_time(resp) is None:
+            raise RuntimeError(resp)
+        return best[0]
+
+    def present_at(self, at_ms: int) -> None:
+        """Hold presentation until `clock_ms()` reaches `at_ms` (after
+        `sync_clock`); updates sent meanwhile show together at that moment."""
+        resp = self.send(f"AT {at_ms & 0xFFFFFFFF}")
+        if not resp.startswith("OK"):
+            raise RuntimeError(resp)
+
+    def watch_state(self, timeout_s: float | None = 30.0) -> Iterator[WallState]:
+        """Follow the device's `/events` stream, yielding what the wall shows
+        after every change from any host or transport; the first event is the
+        current state. Also refreshes the diff cache, so the SETMANY fallback
+        stays correct while other hosts write. Ends when the stream closes;
+        raises on a timeout (the device sends nothing while the wall is idle)."""
+        host = self._require()
+        req = Request(f"http://{host}/events", headers={"Accept": "text/event-stream"})
+        with urlopen(req, timeout=timeout_s) as resp:
+            event, data = "", []
+            for raw in resp:
+                line = raw.decode("utf-8", errors="replace").rstrip("\r\n")
+                if line.startswith("event:"):
+                    event = line[6:].strip()
+                elif line.startswith("data:"):
+                    data.append(line[5:].lstrip())
+                elif not line:
+                    if event == "state" and data:
+                        msg = json.loads("\n".join(data))
+                        state = WallState(
+                            version=int(msg["version"]),
+                            seq=msg.get("seq"),
+                            brightness=int(msg["brightness"]),
+                            colors=decode_hex_frame(msg["frame"]),
+                        )
+                        self._frame_cache = list(state.colors)
+                        yield state
+                    event, data = "", []
+
     def brightness(self, value: int) -> None:
         resp = self.send(f"BRIGHT {int(value)}")
         if not resp.startswith("OK"):
@@ -213,16 +509,85 @@ class LedWifiController:
         if not resp.startswith("OK"):
             raise RuntimeError(resp)
 
+    def light_holds(self, runs: list[tuple[object, tuple[int, int, int]]]) -> None:
+        """Light `(target, color)` runs through the device's hold map (`GRID`):
+        hold ids, `(col, row)` cells, `((col, row), (col, row))` rectangles or
+        region names. Other pixels keep their colors."""
+        for resp in self.send_batch(hold_commands(runs)):
+            if not resp.startswith("OK"):
+                raise RuntimeError(resp)
+        # The device did the mapping; the cache doesn't know which LEDs changed.
+        self._frame_cache = None
+
+    def play_timeline(self, keyframes: list[tuple[int, list[tuple[int, int, int]], str]], loop: bool = False) -> None:
+        """Upload `(ms, colors, ease)` keyframes and play them on the device."""
+        clear, *cmds = timeline_commands(keyframes, loop)
+        # TIMELINE CLEAR can't be rolled back, so batches refuse it.
+        for resp in [self.send(clear)] + self.send_batch(cmds):
+            if not resp.startswith("OK"):
+                raise RuntimeError(resp)
+        # The device animates on its own from here.
+        self._frame_cache = None
+
+    def apply_route(self, route_id: int, colors: list[tuple[int, int, int]]) -> None:
+        """Show a route from the device's route table, uploading it first if stale."""
+        desired = [(int(r), int(g), int(b)) for (r, g, b) in colors]
+        if self._supports_routes:
+            try:
+                if self._device_routes is None:
+                    self._device_routes = parse_route_list(self.send("ROUTE LIST"))
+                if self._device_routes is None:
+                    self._supports_routes = False
+                else:
+                    version = frame_version(desired)
+                    if self._device_routes.get(route_id) != version:
+                        cmd = f"ROUTE SAVE {int(route_id)} {version:08x} {encode_hex_frame(desired)}"
+                        resp = self.send(cmd)
+                        if not resp.startswith("OK"):
+                            raise RuntimeError(resp)
+                        self._device_routes[route_id] = version
+                    resp = self.send(f"{seq_prefix(self._next_seq())}ROUTE LOAD {int(route_id)}")
+                    if not resp.startswith("OK"):
+                        raise RuntimeError(resp)
+                    self._applied(resp, desired)
+                    return
+            except Exception:
+                self._device_routes = None  # Re-read the table next time
+
+        self.set_frame(desired)
+
     def set_frame(self, colors: list[tuple[int, int, int]], force: bool = False) -> None:
         desired = [(int(r), int(g), int(b)) for (r, g, b) in colors]
 
-        # Always try the bulk /frame endpoint first: one HTTP request for all pixels,
-        # orders of magnitude faster than N sequential /cmd requests.
+        # Prefer the persistent frame stream: no TCP or HTTP handshake per update.
+        if self._supports_stream:
+            try:
+                resp = self._send_frame_stream(desired, seq=self._next_seq())
+                if resp.startswith("OK"):
+                    self._applied(resp, desired)
+                    return
+            except Exception:
+                pass
+            # Fall through to the HTTP endpoints, which retry with a fresh seq
+            # (for example after ERR frame queue full).
+
+        # Few-color frames (routes) as palette indices: a short /cmd request
+        # instead of a /frame body of NUM_LEDS * 6 hex chars.
+        if self._supports_palette:
+            resp = self._send_indexed_frame(desired)
+            if resp is not None:
+                self._applied(resp, desired)
+                return
+
+        # Next, the bulk /frame endpoint: one HTTP request for all pixels,
+        # orders of magnitude faster than N sequential /cmd requests. Each
+        # attempt takes a fresh sequence number, so a request that timed out
+        # here but reaches the device late can't overwrite the fallback below.
         try:
-            resp = self._send_frame_fast(desired)
+            resp = self._send_frame_fast(desired, seq=self._next_seq())
             if not resp.startswith("OK"):
                 raise RuntimeError(resp)
-            self._frame_cache = list(desired)
+            self._applied(resp, desired)
             return
         except Exception:
             pass  # Fall through to per-pixel path
@@ -236,6 +601,12 @@ class LedWifiController:
         if not changed_indices:
             return
 
+        if self._supports_setmany:
+            resp = self._send_setmany(desired, changed_indices)
+            if resp is not None:
+                self._applied(resp, desired)
+                return
+
         try:
             for i in changed_indices:
                 r, g, b = desired[i]
@@ -73,7 +73,10 @@ if not routes_path.is_absolute():
 log = logging.getLogger("ledwall")
 
 app = FastAPI(title="LED Wall Controller", version="0.1.0")
-serial_ctrl = LedSerialController(port=os.getenv("LED_PORT"))
+serial_ctrl = LedSerialController(
+    port=os.getenv("LED_PORT"),
+    link_baud=int(os.getenv("LED_SERIAL_BAUD", "0")) or None,
+)
 wifi_ctrl = LedWifiController(host=os.getenv("LED_WIFI_HOST", "192.168.0.5"))
 route_store = RouteStore(path=routes_path, num_leds=35)
 admin_pin = os.getenv("LED_ADMIN_PIN", os.getenv("LED_ROUTE_EDITOR_PIN", "2468"))
@@ -427,7 +430,7 @@ def apply_route(level: int, slot: int):
         route = route_store.get_route(level=level, slot=slot)
         with device_lock:
             _require_connected()
-            ctrl.set_frame(_device_frame(route["frame"]))
+            ctrl.apply_route(route_store.route_id(level, slot), _device_frame(route["frame"]))
         return {"ok": True, "route": route}
     except Exception as e:
         raise _http_error(e, status_code=400)
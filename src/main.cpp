@@ -5,14 +5,174 @@
   controls a WS2812B strip. Commands are ASCII lines; responses are single lines
   starting with "OK" or "ERR".
 
+  Serial commands may be pipelined: a line starting with "#<id> " gets its
+  reply prefixed with the same "#<id> ", so the host can send many commands
+  without waiting for each OK. The serial task works through every complete
+  line already buffered and writes the batch's replies in one go. BAUD
+  switches the UART rate after acknowledging at the old one. On boards whose
+  serial is the native USB CDC port the rate is fixed, and switching replies
+  "ERR BAUD unsupported on USB CDC".
+
+  Full frames can also be sent on serial as a binary packet instead of a FRAME
+  line. A packet is recognised by its first byte (never valid ASCII):
+
+    0xA5 | count (uint16 LE) | count * (r, g, b) | crc16 (uint16 LE)
+
+  The CRC is CRC-16/CCITT-FALSE (poly 0x1021, init 0xFFFF) over the count and
+  payload bytes. Each packet gets the same single-line OK/ERR reply as a command.
+  A packet starting with 0xA6 instead carries a sequence number (see below):
+
+    0xA6 | seq (uint32 LE) | count (uint16 LE) | count * (r, g, b) | crc16
+
+  with the CRC covering seq, count and payload.
+
+  For large walls, a 0xA7 packet carries the frame compressed, with the
+  run-length/back-reference encoding described in
+  lib/LedProtocol/src/LedProtocol.h:
+
+    0xA7 | count (uint16 LE) | len (uint16 LE) | len bytes | crc16
+
+  0xA8 is the same with a seq (uint32 LE) after the magic. The CRC covers
+  everything after the magic, and the payload is inflated
+  straight into the frame slot, so compression costs no extra RAM. INFO lists
+  "LZ 1" when the firmware accepts them. POST /frame takes a single packet of
+  any kind as its body instead of hex.
+
+  Once Wi-Fi is up, the same packets are also accepted back to back on a
+  persistent raw TCP connection (STREAM_PORT), one OK/ERR line per packet. The
+  newest connection replaces any previous one.
+
+  For fire-and-forget realtime lighting the firmware also listens for DDP
+  (Distributed Display Protocol) datagrams on UDP DDP_PORT, so tools like
+  xLights or WLED-style senders can drive the wall directly. Packets with a
+  stale sequence number are dropped; a packet with the PUSH flag presents the
+  frame.
+
+  Boot does not wait for the network: the strip shows the last saved frame
+  (NVS namespace "state", written once a shown frame has stayed unchanged for
+  STATE_SAVE_IDLE_MS) and the serial protocol is up within milliseconds,
+  while Wi-Fi connects in the background. The HTTP,
+  stream and DDP listeners start from the GOT_IP event; the net task retries
+  lost connections.
+
+  Work is split across three FreeRTOS tasks:
+
+    - serial: reads USB serial, runs commands, decodes binary frames
+    - net:    Wi-Fi upkeep, the TCP frame stream and DDP
+    - render: applies queued frames, runs the frame scheduler, calls show()
+
+  HTTP is served by ESPAsyncWebServer, whose handlers run on the AsyncTCP
+  task as data arrives, so concurrent clients (dashboard and admin UI) are
+  multiplexed rather than queued behind one another, and a stalled client
+  holds no task at all.
+
+  Text commands run in the ingest task that received them while holding
+  stateLock, and write the back buffer `leds[]`. Full frames (binary packets,
+  POST /frame, DDP) are decoded without the lock into a slot of their
+  producer's lock-free single-producer/single-consumer FrameQueue and applied by the
+  render task. The render task alone owns the front buffer registered with
+  FastLED, so a slow HTTP client never delays serial commands or the strip.
+
+  Commands that change pixels only mark the frame dirty; the render task
+  presents a dirty frame at most once per frame interval (FPS command, default
+  60), so a burst of SET/FILL/BRIGHT commands costs a single strip write. SHOW
+  presents immediately.
+
+  Routes can be stored on the device (NVS, namespace "routes") with ROUTE SAVE
+  and shown later with ROUTE LOAD <id>, so applying a stored route costs a few
+  bytes instead of a full frame. Each route carries a host-chosen 32-bit
+  version (the backend uses a CRC of the frame) so ROUTE LIST tells the host
+  which routes need re-uploading.
+
+  EFFECT runs a small animation (fade, pulse, chase, route reveal) inside the
+  render task at the frame rate, using FastLED's 8-bit fixed-point math, so
+  animated states need no network traffic at all. Any command or frame that
+  writes pixels stops the running effect.
+
+  TIMELINE plays up to MAX_KEYFRAMES uploaded keyframes the same way: the
+  render task interpolates between them (linear, eased or stepped) at the
+  frame rate, so a countdown or reveal sequence is one upload instead of a
+  stream of frames.
+
+  Holds can be addressed by grid position instead of LED index. GRID stores
+  the wiring (cols, rows, start corner, serpentine, LEDs per hold); the
+  firmware precomputes each hold's LED run from it, GRID MAP overrides single
+  holds, and REGION names sets of holds. HOLD then lights holds, cells,
+  rectangles or regions through that table (NVS namespace "holds").
+
+  The LED layout is configured at runtime (LAYOUT SET, stored in NVS and applied
+  on the next boot): up to MAX_STRIPS strips, each with its own data pin,
+  length and color order. LED indices run through the strips in layout order.
+  FastLED drives the strips in parallel over RMT, so a refresh takes as long as
+  the longest strip, not the total LED count. Each strip needs an RMT TX
+  channel of its own, so MAX_STRIPS is 2 on the ESP32-C3 (it has two) and 4
+  elsewhere. Without a stored layout the
+  firmware drives a single NUM_LEDS strip on DATA_PIN.
+
+  Updates may carry a 32-bit sequence number so several hosts and transports
+  can write without coordinating: a command line prefixed "@<seq> ", a 0xA6
+  packet or POST /frame?seq=<seq>. An update older than the newest one applied
+  (serial-number arithmetic, so it wraps) is dropped last-writer-wins style,
+  and a dropped command replies "OK STALE". Updates sharing a number count as
+  parts of one update. A frame already stale on arrival replies OK STALE and
+  is not queued; the render task checks queued frames again as it applies
+  them, so one that goes stale while queued still replied OK. Untagged
+  updates always apply.
+
+  Several controllers driving one wall can present their slices on the same
+  tick. TIME reads and sets a shared millisecond clock, which the host aligns
+  across boards from the round trip of TIME queries. AT <ms> (or
+  POST /frame?at=<ms>) then holds presentation until the clock reaches ms.
+  Updates arriving meanwhile are applied to the back buffer, and effects
+  started meanwhile start their clock at that moment.
+
+  POST /batch runs a body of newline-separated commands as one transaction:
+  all under a single hold of stateLock, so the wall shows only the end
+  result, with one show(). The reply lists each command's result line; the
+  first ERR rolls the in-memory state back (frame, brightness, effect, seq,
+  AT hold, clock, FPS, palette, timeline) and skips the rest. Commands that
+  can't be rolled back (NVS writes, RESTART, BAUD, WIFI settings, BENCH,
+  STATS RESET, TIMELINE CLEAR) are refused; the read-only forms of those
+  verbs still run. Every other HTTP client waits while a batch runs, so a
+  batch is capped at MAX_BATCH_COMMANDS lines.
+
+  GET /events is a server-sent event stream of what the wall shows: a
+  "state" event with the frame, brightness and newest seq after every
+  present that changed them, at most one per EVENT_MIN_INTERVAL_MS, and one
+  as each client connects. Every transport ends up there, so hosts and UIs
+  can follow the wall without polling it.
+
+  STATS (and GET /stats as JSON) reports counters for tuning: per-verb command
+  counts, latency histograms for commands, show(), render and net task
+  iterations and HTTP handlers, frame accept/drop counts, heap and RSSI.
+
+  BENCH [n] times hex frame decode, binary frame decode, a FRAME command
+  through runCommand and (in the render task) FastLED.show() at the current
+  layout, reporting microseconds per op and ops per second.
+
+  Frames whose colors come from a small set (routes use a handful) can be sent
+  as palette indices: PALETTE uploads up to 16 colors once, then PFRAME
+  carries 1, 2 or 4 bits per LED, expanded into leds[] as it is decoded.
+
+  Output goes through per-channel lookup tables (GAMMA: gamma curve plus a
+  calibration level per channel) as the render task copies the back buffer to
+  the front buffer. The same pass sums the frame's estimated current draw, and
+  with a POWER budget set, frames that would exceed it are shown at a lower
+  brightness. Both settings are stored in NVS (namespace "output").
+
   This firmware is intentionally minimal: it does not "know" physical positions
-  beyond LED indices (0..NUM_LEDS-1) which are determined by strip wiring order.
+  beyond LED indices (0..ledCount-1) which are determined by strip wiring order.
 */
 
 #include <Arduino.h>
 #include <FastLED.h>
 #include <WiFi.h>
-#include <WebServer.h>
+#include <ESPAsyncWebServer.h>
+#include <WiFiUdp.h>
+#include <Preferences.h>
+#include <LedProtocol.h>
+#include <atomic>
+#include <cstdarg>
 #include <cstring>
 
 #ifdef __has_include
@@ -29,296 +189,3172 @@
 #define WIFI_PASSWORD ""
 #endif
 
-#define DATA_PIN 21
+#define DATA_PIN 21        // default layout: one strip of NUM_LEDS on DATA_PIN
 #define NUM_LEDS 35
 #define LED_TYPE WS2812B
-#define COLOR_ORDER GBR
+#define COLOR_ORDER "GBR"
+#define MAX_LEDS 600       // capacity of every frame buffer, across all strips
+#define RESTART_DELAY_MS 250UL
+
+// Data pins a strip may use. Each needs its own FastLED controller
+// instantiation, so the list is fixed at compile time. MAX_STRIPS is the
+// number of RMT TX channels the strips can have to themselves.
+#if CONFIG_IDF_TARGET_ESP32C3
+#define MAX_STRIPS 2
+#define LAYOUT_PINS(X) X(0) X(1) X(2) X(3) X(4) X(5) X(6) X(7) X(8) X(9) X(10) X(20) X(21)
+#else
+#define LAYOUT_PINS(X) X(2) X(4) X(5) X(12) X(13) X(14) X(15) X(16) X(17) X(18) X(19) X(21) X(22) X(23) X(25) X(26) X(27) X(32) X(33)
+#define MAX_STRIPS 4
+#endif
 #define DEFAULT_BRIGHTNESS 32
+#define DEFAULT_GAMMA_X100 100     // 1.00: linear
+#define GAMMA_MIN_X100 100
+#define GAMMA_MAX_X100 300
+#define DEFAULT_POWER_LIMIT_MA 0   // 0: unlimited
+#define MAX_POWER_LIMIT_MA 100000
+#define SERIAL_BAUD 115200
+#define SERIAL_BAUD_MIN 9600
+#define SERIAL_BAUD_MAX 3000000
+
+// USB Serial/JTAG (the ESP32-C3's native USB) always runs at USB speed and
+// ignores line coding, so BAUD has nothing to switch.
+#if ARDUINO_USB_CDC_ON_BOOT && ARDUINO_USB_MODE
+#define SERIAL_USB_CDC 1
+#else
+#define SERIAL_USB_CDC 0
+#endif
+#define SERIAL_RX_BUFFER_BYTES 4096
+#define SERIAL_REPLY_BYTES 1024
+#define LOG_QUEUE_LINES 8
+#define LOG_LINE_CHARS 96
+#define MAX_COMMAND_ID_CHARS 16
 #define MAX_COMMAND_CHARS 8192
-#define WIFI_CONNECT_TIMEOUT_MS 15000UL
+#define RESPONSE_CHARS 1024
+#define MAX_BATCH_CHARS 8192
+#define MAX_BATCH_COMMANDS 32  // a batch holds stateLock on the AsyncTCP task throughout
 #define WIFI_RETRY_INTERVAL_MS 5000UL
+#define WIFI_TX_POWER_MIN_DBM 2
+#define WIFI_TX_POWER_MAX_DBM 20
+#define BIN_FRAME_TIMEOUT_MS 250UL
+#define STREAM_PORT 7777
+#define STREAM_CHUNK_BYTES 512
+#define DDP_PORT 4048
+#define DDP_HEADER_BYTES 10
+#define DDP_TIMECODE_BYTES 4
+#define DDP_MAX_DATA_BYTES 1440
+#define DDP_FLAG_VERSION_MASK 0xC0
+#define DDP_FLAG_VERSION_1 0x40
+#define DDP_FLAG_TIMECODE 0x10
+#define DDP_FLAG_PUSH 0x01
+#define DDP_ID_DEFAULT 1
+#define DDP_ID_ALL 255
+#define DDP_SEQ_RESET_MS 1000UL
+#define DDP_MAX_PACKETS_PER_LOOP 8
+#define FRAME_QUEUE_SLOTS 4
+#define RENDER_TASK_STACK 4096
+#define RENDER_TASK_PRIORITY 3
+#define SERIAL_TASK_STACK 6144
+#define SERIAL_TASK_PRIORITY 2
+#define NET_TASK_STACK 8192
+#define NET_TASK_PRIORITY 1
+
+// On dual-core parts rendering gets its own core, away from the Wi-Fi stack.
+#if portNUM_PROCESSORS > 1
+#define RENDER_TASK_CORE 1
+#define NET_TASK_CORE 0
+#else
+#define RENDER_TASK_CORE tskNO_AFFINITY
+#define NET_TASK_CORE tskNO_AFFINITY
+#endif
+#define DEFAULT_MAX_FPS 60
+#define MAX_FPS_LIMIT 240
+#define MAX_SETMANY_RUNS 256
+#define MAX_ROUTES 32
+#define MAX_PALETTE_COLORS 16  // 4-bit PFRAME indices
+#define MAX_HOLDS 256
+#define MAX_HOLD_RUNS 64
+#define MAX_REGIONS 16
+#define MAX_REGION_NAME_CHARS 15
+#define MAX_COMMAND_VERBS 32
+#define BENCH_DEFAULT_ITERATIONS 100
+#define BENCH_MAX_ITERATIONS 10000
+#define BENCH_MAX_SHOWS 100
+#define MAX_EFFECT_MS 600000UL
+#define MAX_KEYFRAMES 8
+#define MAX_HOLD_MS 10000  // furthest ahead AT may hold presentation
+#define STATE_SAVE_IDLE_MS 3000UL  // how long the shown frame must stay unchanged before it is saved
+#define EVENT_MIN_INTERVAL_MS 100UL  // shortest gap between /events state pushes
+
+// Lock-free ring of whole frames between one ingest task and the render task.
+// The producer decodes straight into acquire()'s slot and publishes it with
+// commit(); a frame that fails validation is simply never committed.
+struct FrameQueue {
+  struct Tag {
+    bool sequenced;
+    uint32_t seq;
+  };
+
+  CRGB slots[FRAME_QUEUE_SLOTS][MAX_LEDS];
+  Tag tags[FRAME_QUEUE_SLOTS];
+  std::atomic<uint8_t> head{0};  // next slot the producer fills
+  std::atomic<uint8_t> tail{0};  // next slot the consumer applies
+
+  CRGB* acquire() {
+    const uint8_t h = head.load(std::memory_order_relaxed);
+    if ((uint8_t)((h + 1) % FRAME_QUEUE_SLOTS) == tail.load(std::memory_order_acquire)) return nullptr;
+    return slots[h];
+  }
+
+  void commit(Tag tag) {
+    const uint8_t h = head.load(std::memory_order_relaxed);
+    tags[h] = tag;
+    head.store((uint8_t)((h + 1) % FRAME_QUEUE_SLOTS), std::memory_order_release);
+  }
+
+  CRGB* front() {
+    const uint8_t t = tail.load(std::memory_order_relaxed);
+    if (t == head.load(std::memory_order_acquire)) return nullptr;
+    return slots[t];
+  }
+
+  const Tag& frontTag() const {
+    return tags[tail.load(std::memory_order_relaxed)];
+  }
+
+  void pop() {
+    const uint8_t t = tail.load(std::memory_order_relaxed);
+    tail.store((uint8_t)((t + 1) % FRAME_QUEUE_SLOTS), std::memory_order_release);
+  }
 
-CRGB leds[NUM_LEDS];
-String line;
-WebServer server(80);
+  bool empty() const {
+    return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+  }
+};
+
+// One physical strip. `order` maps wire position k to source channel
+// order[k] (0 = r, 1 = g, 2 = b); the swizzle happens when the back buffer is
+// copied to the front buffer, so FastLED itself always runs in RGB order.
+struct StripConfig {
+  uint8_t pin;
+  uint16_t length;
+  uint8_t order[3];
+};
+
+StripConfig layout[MAX_STRIPS];
+uint8_t stripCount = 0;
+uint16_t ledCount = 0;  // sum of strip lengths; fixed after boot
+Preferences layoutPrefs;
+unsigned long restartAtMs = 0;  // non-zero: RESTART requested
+
+// Hold map (GRID/REGION commands, NVS namespace "holds"). Hold
+// row * cols + col lights holdLen[] LEDs from holdFirst[], precomputed from
+// the grid so HOLD never walks the wiring.
+struct HoldRegion {
+  char name[MAX_REGION_NAME_CHARS + 1];  // empty: unused slot
+  uint8_t holds[MAX_HOLDS / 8];          // bit per hold
+};
+
+GridGeometry grid;
+uint8_t ledsPerHold = 1;
+uint16_t holdCount = 0;
+uint16_t holdFirst[MAX_HOLDS];
+uint8_t holdLen[MAX_HOLDS];
+HoldRegion regions[MAX_REGIONS];
+Preferences holdPrefs;
+
+// Applied while the back buffer is copied to the front buffer, so output
+// calibration and the power budget cost nothing beyond that copy.
+struct OutputConfig {
+  uint16_t gammaX100 = DEFAULT_GAMMA_X100;
+  uint8_t scale[3] = {255, 255, 255};  // per-channel calibration, r g b
+  uint32_t powerLimitMa = DEFAULT_POWER_LIMIT_MA;
+};
+
+OutputConfig output;
+uint8_t outputLut[3][256];  // gamma and calibration per channel
+Preferences outputPrefs;
+uint32_t frameLoad = 0;       // summed pixelLoad of the front buffer
+uint8_t shownBrightness = 0;  // last show()'s brightness, after the limiter
+
+CRGB leds[MAX_LEDS];       // back buffer: written under stateLock
+CRGB frontLeds[MAX_LEDS];  // front buffer: registered with FastLED, render task only
+FrameQueue serialFrames;   // produced by the serial task
+FrameQueue netFrames;      // produced by the net task
+FrameQueue httpFrames;     // produced by the AsyncTCP task (POST /frame)
+CRGB ddpFrame[MAX_LEDS];   // DDP packets accumulate here until PUSH
+CRGB routeScratch[MAX_LEDS];
+CRGB stateScratch[MAX_LEDS];  // net task's copy of the frame being saved
+Preferences statePrefs;       // last shown frame and brightness, restored at boot
+uint16_t savedStateCrc = 0;   // of the stored frame and brightness
+std::atomic<bool> statePending{false};  // shown since the last save
+std::atomic<uint32_t> stateChangedMs{0};
+std::atomic<uint32_t> shownVersion{0};   // bumped by every present
+std::atomic<bool> eventsResync{false};   // an /events client connected
+CRGB eventScratch[MAX_LEDS];             // net task's copy of the frame being pushed
+char eventJson[MAX_LEDS * 6 + 96];
+uint32_t pushedVersion = 0;
+uint16_t pushedStateCrc = 0;
+unsigned long lastEventMs = 0;
+CRGB palette[MAX_PALETTE_COLORS];  // PFRAME colors; not persisted
+uint8_t paletteSize = 0;
+Preferences routePrefs;
+uint32_t routeVersions[MAX_ROUTES];
+uint32_t routePresentMask = 0;
+SemaphoreHandle_t stateLock = nullptr;
+TaskHandle_t renderTaskHandle = nullptr;
+std::atomic<uint16_t> benchShows{0};  // BENCH: show() passes for the render task to run
+uint8_t benchBrightness = 0;
+unsigned long benchShowUs = 0;
+SemaphoreHandle_t benchDone = nullptr;
+bool benchRunning = false;
+bool frameDirty = false;
+bool presentRequested = false;
+uint16_t maxFps = DEFAULT_MAX_FPS;
+unsigned long lastPresentUs = 0;
+uint32_t lastSeq = 0;  // newest sequence number applied, valid once seqValid
+bool seqValid = false;
+uint32_t clockOffsetMs = 0;  // TIME clock minus millis()
+uint32_t holdUntilMs = 0;   // AT: TIME clock value presentation waits for
+bool holdActive = false;
+char lineBuf[MAX_COMMAND_CHARS + 1];
+LineAssembler serialLine(lineBuf, MAX_COMMAND_CHARS);
+char serialResponse[RESPONSE_CHARS];
+uint32_t serialBaud = SERIAL_BAUD;
+std::atomic<uint32_t> pendingBaud{0};  // set by BAUD, applied once its reply is out
+char httpCommand[MAX_COMMAND_CHARS + 1];
+char httpResponse[RESPONSE_CHARS];
+AsyncWebServer server(80);
+AsyncEventSource events("/events");
+WiFiServer streamServer(STREAM_PORT);
+WiFiClient streamClient;
+WiFiUDP ddpUdp;
+uint8_t ddpPacket[DDP_HEADER_BYTES + DDP_TIMECODE_BYTES + DDP_MAX_DATA_BYTES];
+uint8_t ddpLastSeq = 0;
+unsigned long ddpLastPacketMs = 0;
 
 const char* WIFI_STA_SSID = WIFI_SSID;
 const char* WIFI_STA_PASS = WIFI_PASSWORD;
-bool httpServerStarted = false;
+std::atomic<bool> httpServerStarted{false};  // set once, from the Wi-Fi event task
 unsigned long lastWifiRetryMs = 0;
 
-int clamp8(int v) {
-  if (v < 0) return 0;
-  if (v > 255) return 255;
-  return v;
-}
+// Station link settings (WIFI command, NVS namespace "wifi"). The wall is
+// mains powered, so the default trades idle power for latency: modem sleep
+// off, which otherwise delays every request until the next DTIM beacon.
+struct WifiConfig {
+  bool sleep = false;
+  uint8_t txPowerQdBm = 0;  // in 0.25 dBm; 0 keeps the driver's default
+  uint8_t channel = 0;      // non-zero: join `bssid` on this channel without scanning
+  uint8_t bssid[6] = {};
+  uint32_t ip[4] = {};  // address, gateway, mask, DNS; address 0 uses DHCP
+};
 
-int hexNibble(char c) {
-  if (c >= '0' && c <= '9') return c - '0';
-  if (c >= 'A' && c <= 'F') return 10 + (c - 'A');
-  if (c >= 'a' && c <= 'f') return 10 + (c - 'a');
-  return -1;
+WifiConfig wifiConfig;
+Preferences wifiPrefs;
+std::atomic<uint8_t> wifiAttempts{0};  // since the last successful connect
+std::atomic<bool> wifiReconnectPending{false};  // set by WIFI RECONNECT, run by the net task
+
+struct BinFrameReader : BinFrameParser {
+  FrameQueue* queue;
+  CRGB* target = nullptr;
+  unsigned long lastByteMs = 0;
+
+  explicit BinFrameReader(FrameQueue* q) : queue(q) {}
+};
+
+BinFrameReader binFrame(&serialFrames);
+BinFrameReader streamFrame(&netFrames);
+BinFrameReader httpBinFrame(nullptr);  // decodes into an httpFrames slot; POST /frame commits it
+
+// POST /frame body, decoded as AsyncWebServer hands it over: hex, or one
+// binary packet (into httpBinFrame) when the body starts with a packet magic.
+// Only one body is decoded at a time (`owner`), since httpFrames has a single
+// writable slot.
+struct HexFrameReader : HexStreamDecoder {
+  AsyncWebServerRequest* owner = nullptr;
+  FrameQueue::Tag tag = {false, 0};
+  bool binary = false;
+  bool holding = false;  // ?at= set a hold at atMs
+  uint32_t atMs = 0;
+  int status = 0;  // HTTP status once the body is rejected
+  const char* error = nullptr;
+};
+
+HexFrameReader httpFrame;
+
+// POST /batch body, collected as it arrives; one batch at a time.
+struct BatchReader {
+  AsyncWebServerRequest* owner = nullptr;
+  size_t len = 0;
+  bool overflow = false;
+};
+
+BatchReader httpBatch;
+char batchBody[MAX_BATCH_CHARS + 1];
+uint8_t streamChunk[STREAM_CHUNK_BYTES];
+
+// Collects serial replies so a pipelined batch goes out in a single write once
+// the serial task runs out of buffered lines.
+struct SerialReplies : public Print {
+  uint8_t buf[SERIAL_REPLY_BYTES];
+  size_t len = 0;
+
+  size_t write(uint8_t b) override {
+    return write(&b, 1);
+  }
+
+  size_t write(const uint8_t* data, size_t n) override {
+    if (len + n > sizeof(buf)) flush();
+    if (n > sizeof(buf)) return Serial.write(data, n);
+    memcpy(buf + len, data, n);
+    len += n;
+    return n;
+  }
+
+  void flush() override {
+    if (len == 0) return;
+    Serial.write(buf, len);
+    len = 0;
+  }
+
+  using Print::write;
+};
+
+SerialReplies serialOut;
+QueueHandle_t logQueue = nullptr;  // status lines from other tasks, for the serial task
+
+// Queues a status line for the serial task, which writes it between replies
+// so it never lands inside a pipelined batch. Dropped if the queue is full.
+void logLine(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+void logLine(const char* fmt, ...) {
+  if (logQueue == nullptr) return;
+  char line[LOG_LINE_CHARS];
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(line, sizeof(line), fmt, ap);
+  va_end(ap);
+  xQueueSend(logQueue, line, 0);
 }
 
-bool parseHexByte(const String& s, int offset, uint8_t& out) {
-  if (offset < 0 || offset + 1 >= s.length()) return false;
-  int hi = hexNibble(s[offset]);
-  int lo = hexNibble(s[offset + 1]);
-  if (hi < 0 || lo < 0) return false;
-  out = (uint8_t)((hi << 4) | lo);
-  return true;
+void writeQueuedLogs() {
+  char line[LOG_LINE_CHARS];
+  while (xQueueReceive(logQueue, line, 0) == pdTRUE) serialOut.println(line);
 }
 
-bool applyHexFrame(const String& hex) {
-  if (hex.length() != NUM_LEDS * 6) {
-    return false;
+// Timing samples per code path. Each is written by a single task (or under
+// stateLock); STATS reads them unlocked, which is fine for diagnostics.
+struct Stats {
+  LatencyStat command;  // runCommand, under stateLock
+  LatencyStat show;     // FastLED.show(), render task
+  LatencyStat render;   // locked part of a render task iteration
+  LatencyStat http;     // one AsyncWebServer callback
+  LatencyStat net;      // one net task iteration
+  uint32_t commandCounts[MAX_COMMAND_VERBS] = {};  // by COMMANDS index, under stateLock
+  std::atomic<uint32_t> framesApplied{0};
+  std::atomic<uint32_t> framesStale{0};     // queued frames dropped by sequence number
+  std::atomic<uint32_t> framesRejected{0};  // bad CRC/count/hex, timeouts, queue full
+  std::atomic<uint32_t> commandsStale{0};
+  std::atomic<uint32_t> ddpDropped{0};
+};
+
+Stats stats;
+
+// Records the lifetime of a scope into `st`.
+struct LatencyTimer {
+  LatencyStat& st;
+  const unsigned long startUs;
+
+  explicit LatencyTimer(LatencyStat& s) : st(s), startUs(micros()) {}
+  ~LatencyTimer() {
+    recordLatency(st, (uint32_t)(micros() - startUs));
   }
+};
 
-  for (int i = 0; i < NUM_LEDS; i++) {
-    const int o = i * 6;
-    uint8_t r, g, b;
-    if (!parseHexByte(hex, o, r) || !parseHexByte(hex, o + 2, g) || !parseHexByte(hex, o + 4, b)) {
-      return false;
+// Holds stateLock for the enclosing scope.
+struct StateGuard {
+  StateGuard() {
+    xSemaphoreTake(stateLock, portMAX_DELAY);
+  }
+  ~StateGuard() {
+    xSemaphoreGive(stateLock);
+  }
+};
+
+enum EffectKind : uint8_t {
+  EFFECT_NONE,
+  EFFECT_FADE,    // blend from the base frame to `color` over `durationMs`, then stop
+  EFFECT_PULSE,   // breathe the base frame between `floor` and full, `durationMs` per cycle
+  EFFECT_CHASE,   // `width` pixels of `color` stepping along the strip every `durationMs`
+  EFFECT_REVEAL,  // light the base frame's lit pixels one by one over `durationMs`
+  EFFECT_TIMELINE,  // interpolate from the base frame through the TIMELINE keyframes
+};
+
+enum KeyEase : uint8_t {
+  KEY_LINEAR,
+  KEY_EASE,  // ease in and out (cubic)
+  KEY_STEP,  // hold the previous frame, then jump
+};
+
+struct EffectState {
+  EffectKind kind = EFFECT_NONE;
+  unsigned long startMs = 0;
+  uint32_t durationMs = 0;
+  CRGB color;
+  uint8_t floor = 0;
+  uint8_t width = 1;
+  uint16_t litCount = 0;
+  bool loop = false;
+  bool deferred = false;  // started during an AT hold; startMs is reset when it ends
+};
+
+EffectState effect;
+CRGB effectBase[MAX_LEDS];  // back buffer as it was when the effect started
+
+// TIMELINE keyframes: frame, time since the start of playback, and the easing
+// used on the way to it.
+CRGB keyframeLeds[MAX_KEYFRAMES][MAX_LEDS];
+uint32_t keyframeMs[MAX_KEYFRAMES];
+KeyEase keyframeEase[MAX_KEYFRAMES];
+uint8_t keyframeCount = 0;
+
+size_t frameBytes() {
+  return (size_t)ledCount * sizeof(CRGB);
+}
+
+// Copies the back buffer to the front buffer through the output LUTs,
+// applying each strip's color order. The frame's current draw is summed on
+// the way, so the power limiter never has to rescan the pixels.
+void copyToFront() {
+  uint32_t load = 0;
+  uint16_t offset = 0;
+  for (uint8_t s = 0; s < stripCount; s++) {
+    const StripConfig& strip = layout[s];
+    const uint8_t* order = strip.order;
+    for (uint16_t i = offset; i < offset + strip.length; i++) {
+      const CRGB& src = leds[i];
+      const CRGB out(outputLut[0][src.r], outputLut[1][src.g], outputLut[2][src.b]);
+      load += pixelLoad(out.r, out.g, out.b);
+      frontLeds[i] = CRGB(out.raw[order[0]], out.raw[order[1]], out.raw[order[2]]);
     }
-    leds[i] = CRGB(r, g, b);
+    offset += strip.length;
   }
+  frameLoad = load;
+}
 
-  FastLED.show();
-  return true;
+// Brightness for the next show(), held under the power budget.
+uint8_t outputBrightness() {
+  return limitBrightness(frameLoad, ledCount, FastLED.getBrightness(), output.powerLimitMa);
 }
 
-void replyErr(const String& msg) {
-  Serial.print("ERR ");
-  Serial.println(msg);
+// The shared clock TIME sets and AT refers to.
+uint32_t clockMs() {
+  return millis() + clockOffsetMs;
 }
 
-String runCommand(const String& raw) {
-  String cmd = raw;
-  cmd.trim();
-  cmd.toUpperCase();
+void stopEffect() {
+  effect.kind = EFFECT_NONE;
+}
 
-  if (cmd == "PING") {
-    return "OK";
-  }
-  else if (cmd == "INFO") {
-    return "OK NUM_LEDS " + String(NUM_LEDS) + " BRIGHT " + String(FastLED.getBrightness());
+// Marks the back buffer as changed without touching the running effect.
+void markDirty() {
+  frameDirty = true;
+  xTaskNotifyGive(renderTaskHandle);
+}
+
+// Marks the back buffer as changed by a command or incoming frame; the render
+// task presents it on its next frame tick. Call with stateLock held.
+void requestShow() {
+  stopEffect();
+  markDirty();
+}
+
+// Asks the render task to present the back buffer right away (SHOW).
+void presentFrame() {
+  presentRequested = true;
+  xTaskNotifyGive(renderTaskHandle);
+}
+
+// Keeps a task's own commands ordered after the frames it already queued.
+void waitForDrain(const FrameQueue& q) {
+  while (!q.empty()) vTaskDelay(1);
+}
+
+// Last-writer-wins check for a tagged update. Call with stateLock held.
+bool seqIsStale(uint32_t seq) {
+  return seqValid && (int32_t)(seq - lastSeq) < 0;
+}
+
+void acceptSeq(uint32_t seq) {
+  lastSeq = seq;
+  seqValid = true;
+}
+
+// Queues the producer's slot for the render task. A sequenced frame that is
+// already stale is dropped here instead (false), so its sender can be told
+// OK STALE; one that only goes stale while queued is dropped by the render
+// task after its OK.
+bool commitFrame(FrameQueue& q, FrameQueue::Tag tag = {false, 0}) {
+  if (tag.sequenced) {
+    StateGuard guard;
+    if (seqIsStale(tag.seq)) {
+      stats.framesStale++;
+      return false;
+    }
   }
-  else if (cmd.startsWith("BRIGHT ")) {
-    int b;
-    if (sscanf(cmd.c_str(), "BRIGHT %d", &b) == 1) {
-      FastLED.setBrightness(clamp8(b));
-      FastLED.show();
-      return "OK";
+  q.commit(tag);
+  xTaskNotifyGive(renderTaskHandle);
+  return true;
+}
+
+void drainFrameQueue(FrameQueue& q) {
+  while (CRGB* frame = q.front()) {
+    const FrameQueue::Tag& tag = q.frontTag();
+    if (!tag.sequenced || !seqIsStale(tag.seq)) {
+      if (tag.sequenced) acceptSeq(tag.seq);
+      memcpy(leds, frame, frameBytes());
+      stopEffect();
+      frameDirty = true;
+      stats.framesApplied++;
+    } else {
+      stats.framesStale++;
     }
-    return "ERR usage: BRIGHT <0-255>";
+    q.pop();
   }
-  else if (cmd.startsWith("FILL ")) {
-    int r, g, b;
-    if (sscanf(cmd.c_str(), "FILL %d %d %d", &r, &g, &b) == 3) {
-      fill_solid(leds, NUM_LEDS, CRGB(clamp8(r), clamp8(g), clamp8(b)));
-      FastLED.show();
-      return "OK";
-    }
-    return "ERR usage: FILL <r> <g> <b>";
-  }
-  else if (cmd.startsWith("SET ")) {
-    int i, r, g, b;
-    if (sscanf(cmd.c_str(), "SET %d %d %d %d", &i, &r, &g, &b) == 4) {
-      if (i < 0 || i >= NUM_LEDS) {
-        return "ERR index out of range";
+}
+
+// Renders the running effect into leds[] for time `now`. Call with stateLock held.
+void renderEffect(unsigned long now) {
+  const uint32_t elapsed = now - effect.startMs;
+  const uint32_t duration = effect.durationMs;
+
+  switch (effect.kind) {
+    case EFFECT_FADE: {
+      const uint8_t t = elapsed >= duration ? 255 : (uint8_t)((elapsed * 255UL) / duration);
+      const fract8 amount = ease8InOutCubic(t);
+      for (int i = 0; i < ledCount; i++) {
+        leds[i] = blend(effectBase[i], effect.color, amount);
       }
-      leds[i] = CRGB(clamp8(r), clamp8(g), clamp8(b));
-      FastLED.show();
-      return "OK";
+      if (t == 255) stopEffect();
+      break;
     }
-    return "ERR usage: SET <index> <r> <g> <b>";
-  }
-  else if (cmd.startsWith("SETN ")) {
-    int i, r, g, b;
-    if (sscanf(cmd.c_str(), "SETN %d %d %d %d", &i, &r, &g, &b) == 4) {
-      if (i < 0 || i >= NUM_LEDS) {
-        return "ERR index out of range";
+    case EFFECT_PULSE: {
+      const uint8_t phase = (uint8_t)(((elapsed % duration) * 256UL) / duration);
+      const uint8_t level = effect.floor + scale8(cubicwave8(phase), 255 - effect.floor);
+      for (int i = 0; i < ledCount; i++) {
+        leds[i] = effectBase[i];
+        leds[i].nscale8_video(level);
       }
-      leds[i] = CRGB(clamp8(r), clamp8(g), clamp8(b));
-      return "OK";
+      break;
     }
-    return "ERR usage: SETN <index> <r> <g> <b>";
-  }
-  else if (cmd == "SHOW") {
-    FastLED.show();
-    return "OK";
-  }
-  else if (cmd == "CLEAR") {
-    FastLED.clear(true);
-    return "OK";
-  }
-  else if (cmd.startsWith("FRAME ")) {
-    String payload = cmd.substring(6);
-    payload.trim();
-    if (applyHexFrame(payload)) {
-      return "OK";
+    case EFFECT_CHASE: {
+      const uint32_t head = (elapsed / duration) % ledCount;
+      fill_solid(leds, ledCount, CRGB::Black);
+      for (uint8_t w = 0; w < effect.width; w++) {
+        leds[(head + ledCount - w) % ledCount] = effect.color;
+      }
+      break;
+    }
+    case EFFECT_REVEAL: {
+      if (elapsed >= duration || effect.litCount == 0) {
+        memcpy(leds, effectBase, frameBytes());
+        stopEffect();
+        break;
+      }
+      // The pixel currently being revealed fades in over its share of the time.
+      const uint32_t progress = elapsed * effect.litCount;
+      const uint16_t shown = progress / duration;
+      const uint8_t fadeIn = (uint8_t)(((progress % duration) * 255UL) / duration);
+      uint16_t lit = 0;
+      for (int i = 0; i < ledCount; i++) {
+        if (!effectBase[i]) {
+          leds[i] = CRGB::Black;
+          continue;
+        }
+        leds[i] = effectBase[i];
+        if (lit == shown) {
+          leds[i].nscale8_video(fadeIn);
+        } else if (lit > shown) {
+          leds[i] = CRGB::Black;
+        }
+        lit++;
+      }
+      break;
+    }
+    case EFFECT_TIMELINE: {
+      if (keyframeCount == 0) {
+        stopEffect();
+        return;
+      }
+      // A loop comes back round from the last keyframe instead of the base frame.
+      const uint32_t end = keyframeMs[keyframeCount - 1];
+      const uint32_t t = effect.loop && end > 0 ? elapsed % end : elapsed;
+      uint8_t amount;
+      const uint8_t to = timelineSegment(keyframeMs, keyframeCount, t, amount);
+      const CRGB* from = to > 0 ? keyframeLeds[to - 1] : effect.loop ? keyframeLeds[keyframeCount - 1] : effectBase;
+      if (keyframeEase[to] == KEY_EASE) {
+        amount = ease8InOutCubic(amount);
+      } else if (keyframeEase[to] == KEY_STEP && amount < 255) {
+        amount = 0;
+      }
+      for (int i = 0; i < ledCount; i++) {
+        leds[i] = blend(from[i], keyframeLeds[to][i], amount);
+      }
+      if (!effect.loop && elapsed >= end) stopEffect();
+      break;
     }
-    return "ERR usage: FRAME <hex rgb payload of length NUM_LEDS*6>";
+    default:
+      return;
   }
+  frameDirty = true;
+}
 
-  return "ERR unknown command";
+// BENCH's show() pass. Runs in the render task, the only one that drives
+// FastLED, while BENCH waits with stateLock released.
+void runBenchShows() {
+  const uint16_t n = benchShows.load();
+  const unsigned long startUs = micros();
+  for (uint16_t i = 0; i < n; i++) {
+    FastLED.show(benchBrightness);
+  }
+  benchShowUs = micros() - startUs;
+  benchShows.store(0);
+  xSemaphoreGive(benchDone);
 }
 
-bool readLine(String& out) {
-  while (Serial.available()) {
-    char c = (char)Serial.read();
-    if (c == '\r') continue;
-    if (c == '\n') {
-      out.trim();
-      return true;
+// Applies queued frames, then copies the back buffer into the front buffer at
+// most once per frame interval and clocks it out. FastLED's ESP32 RMT driver
+// blocks this task (not the CPU) while the frame is transmitted.
+void renderTask(void*) {
+  TickType_t wait = portMAX_DELAY;
+  for (;;) {
+    ulTaskNotifyTake(pdTRUE, wait);
+    if (benchShows.load() != 0) runBenchShows();
+
+    bool show = false;
+    uint8_t brightness = 0;
+    {
+      StateGuard guard;
+      LatencyTimer timer(stats.render);
+      drainFrameQueue(serialFrames);
+      drainFrameQueue(netFrames);
+      drainFrameQueue(httpFrames);
+
+      const unsigned long now = micros();
+      const unsigned long interval = 1000000UL / maxFps;
+      const unsigned long elapsed = now - lastPresentUs;
+      wait = portMAX_DELAY;
+      if (holdActive) {
+        const int32_t left = (int32_t)(holdUntilMs - clockMs());
+        if (left > 0) {
+          wait = pdMS_TO_TICKS(left);
+          continue;  // releases stateLock; the pending frame stays dirty
+        }
+        holdActive = false;
+        if (frameDirty || effect.kind != EFFECT_NONE) presentRequested = true;
+        if (effect.deferred) {
+          effect.startMs = millis();
+          effect.deferred = false;
+        }
+      }
+      if (effect.kind != EFFECT_NONE && (elapsed >= interval || presentRequested)) {
+        renderEffect(millis());
+      }
+      if (presentRequested || (frameDirty && elapsed >= interval)) {
+        copyToFront();
+        brightness = outputBrightness();
+        shownBrightness = brightness;
+        presentRequested = false;
+        frameDirty = false;
+        lastPresentUs = now;
+        statePending.store(true);
+        stateChangedMs.store(millis());
+        shownVersion.fetch_add(1);
+        show = true;
+      } else if (frameDirty || effect.kind != EFFECT_NONE) {
+        wait = pdMS_TO_TICKS((interval - elapsed) / 1000 + 1);
+      }
+      if (show && effect.kind != EFFECT_NONE) {
+        wait = pdMS_TO_TICKS(interval / 1000);
+      }
     }
-    out += c;
-    if (out.length() > MAX_COMMAND_CHARS) {
-      out = "";
-      replyErr("line too long");
+
+    if (show) {
+      LatencyTimer timer(stats.show);
+      FastLED.show(brightness);
     }
   }
-  return false;
 }
 
-bool connectWifiStation() {
-  if (std::strlen(WIFI_STA_SSID) == 0) {
-    Serial.println("WARN Wi-Fi credentials missing. Add include/wifi_secrets.h");
+int clamp8(int v) {
+  if (v < 0) return 0;
+  if (v > 255) return 255;
+  return v;
+}
+
+// Decodes "RRGGBB" per LED straight into CRGB memory (laid out as r, g, b).
+bool decodeHexFrame(const char* hex, size_t len, CRGB* out) {
+  if (len != (size_t)ledCount * 6) {
     return false;
   }
+  return decodeHex(hex, len, reinterpret_cast<uint8_t*>(out));
+}
 
-  WiFi.mode(WIFI_STA);
-  WiFi.setAutoReconnect(true);
-  WiFi.persistent(false);
-  WiFi.begin(WIFI_STA_SSID, WIFI_STA_PASS);
+// A reader without a queue decodes into its preset `target` and commits
+// nothing (BENCH, and POST /frame, which commits once the whole body is in).
+void beginBinFrame(BinFrameReader& f, uint8_t magic) {
+  if (f.queue != nullptr) f.target = f.queue->acquire();
+  binFrameBegin(f, magic);
+  f.lastByteMs = millis();
+}
 
-  Serial.print("Connecting to Wi-Fi SSID: ");
-  Serial.println(WIFI_STA_SSID);
+// Feeds one byte of a binary frame packet. Payload bytes are written straight
+// into the reader's FrameQueue slot while the CRC is accumulated; the slot is
+// committed only if the packet checks out. A packet whose count doesn't match
+// ledCount, or that arrives while the queue is full, is still consumed so the
+// stream stays in sync, but nothing is written. Returns true once the packet
+// is complete; `response` is then set to the reply line.
+bool feedBinFrame(BinFrameReader& f, uint8_t b, const char*& response) {
+  f.lastByteMs = millis();
+  if (!binFrameFeed(f, b, reinterpret_cast<uint8_t*>(f.target), ledCount)) return false;
 
-  const unsigned long startedAt = millis();
-  while (WiFi.status() != WL_CONNECTED && millis() - startedAt < WIFI_CONNECT_TIMEOUT_MS) {
-    delay(250);
-    Serial.print(".");
+  if (f.count != ledCount) {
+    response = "ERR binary frame count must equal NUM_LEDS";
+  } else if (f.crc != f.expectedCrc) {
+    response = "ERR binary frame crc mismatch";
+  } else if (f.target == nullptr) {
+    response = "ERR frame queue full";
+  } else if (!binFrameDecoded(f)) {
+    response = "ERR compressed frame invalid";
+  } else {
+    const bool fresh = f.queue == nullptr || commitFrame(*f.queue, {f.sequenced, f.seq});
+    response = fresh ? "OK" : "OK STALE";
+    return true;
   }
-  Serial.println();
+  stats.framesRejected++;
+  return true;
+}
 
-  if (WiFi.status() != WL_CONNECTED) {
-    Serial.print("ERR Wi-Fi connect failed, status=");
-    Serial.println((int)WiFi.status());
-    return false;
+// Drops a packet that stalled mid-transfer so the stream can resync.
+void expireBinFrame(BinFrameReader& f, Print& out) {
+  if (f.state != BIN_IDLE && millis() - f.lastByteMs > BIN_FRAME_TIMEOUT_MS) {
+    f.state = BIN_IDLE;
+    stats.framesRejected++;
+    out.println("ERR binary frame timeout");
   }
+}
 
-  Serial.print("Wi-Fi connected, IP: ");
-  Serial.println(WiFi.localIP());
-  return true;
+void replyErr(const char* msg) {
+  serialOut.print("ERR ");
+  serialOut.println(msg);
 }
 
-void maintainWifiConnection() {
-  if (std::strlen(WIFI_STA_SSID) == 0) {
+void cmdPing(char* args, Response& res) {
+  res.set("OK");
+}
+
+void cmdInfo(char* args, Response& res) {
+  res.format("OK NUM_LEDS %u BRIGHT %u FPS %u STRIPS %u LZ 1", ledCount, FastLED.getBrightness(), maxFps,
+             stripCount);
+}
+
+void cmdBright(char* args, Response& res) {
+  int b;
+  if (!nextInt(args, b) || !atEnd(args)) {
+    res.set("ERR usage: BRIGHT <0-255>");
     return;
   }
-  if (WiFi.status() == WL_CONNECTED) {
+  FastLED.setBrightness(clamp8(b));
+  markDirty();
+  res.set("OK");
+}
+
+void cmdFill(char* args, Response& res) {
+  int r, g, b;
+  if (!nextInt(args, r) || !nextInt(args, g) || !nextInt(args, b) || !atEnd(args)) {
+    res.set("ERR usage: FILL <r> <g> <b>");
     return;
   }
+  fill_solid(leds, ledCount, CRGB(clamp8(r), clamp8(g), clamp8(b)));
+  requestShow();
+  res.set("OK");
+}
 
-  const unsigned long now = millis();
-  if (now - lastWifiRetryMs < WIFI_RETRY_INTERVAL_MS) {
-    return;
+// Shared by SET and SETN; returns false (with `res` set) on bad input.
+bool setPixelFromArgs(char* args, Response& res, const char* usage) {
+  int i, r, g, b;
+  if (!nextInt(args, i) || !nextInt(args, r) || !nextInt(args, g) || !nextInt(args, b) || !atEnd(args)) {
+    res.set(usage);
+    return false;
   }
-  lastWifiRetryMs = now;
+  if (i < 0 || i >= ledCount) {
+    res.set("ERR index out of range");
+    return false;
+  }
+  stopEffect();
+  leds[i] = CRGB(clamp8(r), clamp8(g), clamp8(b));
+  res.set("OK");
+  return true;
+}
 
-  Serial.println("Wi-Fi disconnected, retrying...");
-  WiFi.disconnect();
-  WiFi.begin(WIFI_STA_SSID, WIFI_STA_PASS);
+void cmdSet(char* args, Response& res) {
+  if (setPixelFromArgs(args, res, "ERR usage: SET <index> <r> <g> <b>")) {
+    requestShow();
+  }
 }
 
-void setup() {
-  Serial.begin(115200);
-  delay(2000);  // Increased delay to ensure ESP32 is fully ready
-  line.reserve(MAX_COMMAND_CHARS + 8);
+void cmdSetN(char* args, Response& res) {
+  setPixelFromArgs(args, res, "ERR usage: SETN <index> <r> <g> <b>");
+}
 
-  FastLED.addLeds<LED_TYPE, DATA_PIN, COLOR_ORDER>(leds, NUM_LEDS);
-  FastLED.setBrightness(DEFAULT_BRIGHTNESS);
-  FastLED.clear(true);
+struct PixelRun {
+  uint16_t first;
+  uint16_t last;
+  CRGB color;
+};
 
-  const bool wifiConnected = connectWifiStation();
+PixelRun setManyRuns[MAX_SETMANY_RUNS];
 
-  server.on("/", HTTP_GET, []() {
-    String msg = "LED Wall ESP32 STA ready\n";
-    msg += "SSID: ";
-    msg += WIFI_STA_SSID;
-    msg += "\nIP: ";
-    msg += (WiFi.status() == WL_CONNECTED) ? WiFi.localIP().toString() : "DISCONNECTED";
-    msg += "\nUse /cmd?q=PING\n";
-    server.send(200, "text/plain", msg);
-  });
+// Parses "<i>" or "<first>-<last>" (inclusive) into a run.
+bool parseIndexRange(const char* tok, PixelRun& run) {
+  char* end;
+  long first = strtol(tok, &end, 10);
+  long last = first;
+  if (*end == '-') {
+    last = strtol(end + 1, &end, 10);
+  }
+  if (end == tok || *end != '\0') return false;
+  if (first < 0 || last < first || last >= ledCount) return false;
+  run.first = (uint16_t)first;
+  run.last = (uint16_t)last;
+  return true;
+}
 
-  server.on("/cmd", HTTP_GET, []() {
-    String q = server.arg("q");
-    if (q.length() == 0) {
-      server.send(400, "text/plain", "ERR missing q");
+// SETMANY <i|first-last> <r> <g> <b> [...]: applies every run with a single
+// show. The whole list is validated before any pixel changes.
+void cmdSetMany(char* args, Response& res) {
+  size_t count = 0;
+  while (!atEnd(args)) {
+    if (count >= MAX_SETMANY_RUNS) {
+      res.set("ERR too many runs");
       return;
     }
-    String response = runCommand(q);
-    int code = response.startsWith("OK") ? 200 : 400;
-    server.send(code, "text/plain", response);
-  });
-
-  server.on("/frame", HTTP_POST, []() {
-    if (!server.hasArg("plain")) {
-      server.send(400, "text/plain", "ERR missing body");
+    PixelRun& run = setManyRuns[count];
+    char* range = nextToken(args);
+    int r, g, b;
+    if (!nextInt(args, r) || !nextInt(args, g) || !nextInt(args, b)) {
+      res.set("ERR usage: SETMANY <i|first-last> <r> <g> <b> [...]");
+      return;
+    }
+    if (!parseIndexRange(range, run)) {
+      res.set("ERR index out of range");
       return;
     }
+    run.color = CRGB(clamp8(r), clamp8(g), clamp8(b));
+    count++;
+  }
+  if (count == 0) {
+    res.set("ERR usage: SETMANY <i|first-last> <r> <g> <b> [...]");
+    return;
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    const PixelRun& run = setManyRuns[i];
+    fill_solid(leds + run.first, run.last - run.first + 1, run.color);
+  }
+  requestShow();
+  res.set("OK");
+}
+
+void cmdShow(char* args, Response& res) {
+  presentFrame();
+  res.set("OK");
+}
+
+void cmdClear(char* args, Response& res) {
+  fill_solid(leds, ledCount, CRGB::Black);
+  requestShow();
+  res.set("OK");
+}
+
+void cmdFps(char* args, Response& res) {
+  int fps;
+  if (!nextInt(args, fps) || !atEnd(args) || fps < 1 || fps > MAX_FPS_LIMIT) {
+    res.set("ERR usage: FPS <1-240>");
+    return;
+  }
+  maxFps = (uint16_t)fps;
+  res.set("OK");
+}
 
-    String payload = server.arg("plain");
-    payload.trim();
-    bool applied = applyHexFrame(payload);
+void cmdFrame(char* args, Response& res) {
+  char* payload = args;
+  while (isSpace(*payload)) payload++;
+  if (decodeHexFrame(payload, trimEnd(payload, strlen(payload)), leds)) {
+    requestShow();
+    res.set("OK");
+    return;
+  }
+  res.set("ERR usage: FRAME <hex rgb payload of length NUM_LEDS*6>");
+}
 
-    if (applied) {
-      server.send(200, "text/plain", "OK");
+// PALETTE <RRGGBB> [...] sets the colors PFRAME indices refer to; PALETTE
+// alone lists them. Lost on reboot, so hosts re-send it after connecting.
+void cmdPalette(char* args, Response& res) {
+  if (atEnd(args)) {
+    res.set("OK PALETTE");
+    for (uint8_t i = 0; i < paletteSize; i++) {
+      res.append(" %02X%02X%02X", palette[i].r, palette[i].g, palette[i].b);
+    }
+    return;
+  }
+  CRGB colors[MAX_PALETTE_COLORS];
+  uint8_t count = 0;
+  while (char* tok = nextToken(args)) {
+    if (count >= MAX_PALETTE_COLORS || strlen(tok) != 6 || !decodeHex(tok, 6, colors[count].raw)) {
+      res.format("ERR usage: PALETTE <RRGGBB> [...] (max %d colors)", MAX_PALETTE_COLORS);
       return;
     }
+    count++;
+  }
+  memcpy(palette, colors, sizeof(CRGB) * count);
+  paletteSize = count;
+  res.set("OK");
+}
 
-    server.send(400, "text/plain", "ERR invalid frame payload");
-  });
+// PFRAME <bits> <hex>: a full frame as one PALETTE index per LED, 1, 2 or 4
+// bits wide, packed MSB first. A route frame with four colors is 2 bits per
+// LED, a twelfth of FRAME's hex.
+void cmdPFrame(char* args, Response& res) {
+  int bits;
+  char* hex = nullptr;
+  if (!nextInt(args, bits) || bits < 1 || bits > 4 || (hex = nextToken(args)) == nullptr || !atEnd(args) ||
+      !decodeIndexedFrame(hex, strlen(hex), (uint8_t)bits, reinterpret_cast<const uint8_t*>(palette), paletteSize,
+                          ledCount, reinterpret_cast<uint8_t*>(leds))) {
+    res.set("ERR usage: PFRAME <1|2|4> <hex of NUM_LEDS palette indices>");
+    return;
+  }
+  requestShow();
+  res.set("OK");
+}
+
+bool nextDuration(char*& args, uint32_t& ms) {
+  int v;
+  if (!nextInt(args, v) || v < 1 || (uint32_t)v > MAX_EFFECT_MS) return false;
+  ms = (uint32_t)v;
+  return true;
+}
+
+bool nextColor(char*& args, CRGB& color) {
+  int r, g, b;
+  if (!nextInt(args, r) || !nextInt(args, g) || !nextInt(args, b)) return false;
+  color = CRGB(clamp8(r), clamp8(g), clamp8(b));
+  return true;
+}
+
+// Snapshots the back buffer as the effect's base frame and starts `kind`.
+void startEffect(const EffectState& next) {
+  memcpy(effectBase, leds, frameBytes());
+  effect = next;
+  effect.startMs = millis();
+  effect.deferred = holdActive;
+  markDirty();
+}
 
-  if (wifiConnected) {
-    server.begin();
-    httpServerStarted = true;
+void cmdEffectFade(char* args, Response& res) {
+  EffectState next;
+  next.kind = EFFECT_FADE;
+  if (!nextColor(args, next.color) || !nextDuration(args, next.durationMs) || !atEnd(args)) {
+    res.set("ERR usage: EFFECT FADE <r> <g> <b> <ms>");
+    return;
   }
+  startEffect(next);
+  res.set("OK");
+}
 
-  Serial.println("READY");
-  if (wifiConnected) {
-    Serial.print("Wi-Fi SSID: ");
-    Serial.println(WIFI_STA_SSID);
-    Serial.print("Wi-Fi IP: ");
-    Serial.println(WiFi.localIP());
-  } else {
-    Serial.println("HTTP disabled until Wi-Fi connects.");
+void cmdEffectPulse(char* args, Response& res) {
+  EffectState next;
+  next.kind = EFFECT_PULSE;
+  int floor = 0;
+  if (!nextDuration(args, next.durationMs) || (!atEnd(args) && !nextInt(args, floor)) || !atEnd(args)) {
+    res.set("ERR usage: EFFECT PULSE <period ms> [floor 0-255]");
+    return;
   }
+  next.floor = (uint8_t)clamp8(floor);
+  startEffect(next);
+  res.set("OK");
 }
 
-void loop() {
-  maintainWifiConnection();
-  if (!httpServerStarted && WiFi.status() == WL_CONNECTED) {
-    server.begin();
-    httpServerStarted = true;
-    Serial.print("HTTP server started, IP: ");
-    Serial.println(WiFi.localIP());
-  }
-  if (httpServerStarted) {
-    server.handleClient();
-  }
-
-  if (readLine(line)) {
-    String response = runCommand(line);
-    if (response.startsWith("OK")) {
-      Serial.println(response);
-    } else if (response.startsWith("ERR ")) {
-      replyErr(response.substring(4));
-    } else {
-      Serial.println(response);
-    }
-    line = "";
+void cmdEffectChase(char* args, Response& res) {
+  EffectState next;
+  next.kind = EFFECT_CHASE;
+  int width = 1;
+  if (!nextColor(args, next.color) || !nextDuration(args, next.durationMs) ||
+      (!atEnd(args) && !nextInt(args, width)) || !atEnd(args) || width < 1 || width > ledCount || width > 255) {
+    res.set("ERR usage: EFFECT CHASE <r> <g> <b> <ms per step> [width]");
+    return;
+  }
+  next.width = (uint8_t)width;
+  startEffect(next);
+  res.set("OK");
+}
+
+void cmdEffectReveal(char* args, Response& res) {
+  EffectState next;
+  next.kind = EFFECT_REVEAL;
+  if (!nextDuration(args, next.durationMs) || !atEnd(args)) {
+    res.set("ERR usage: EFFECT REVEAL <ms>");
+    return;
   }
+  for (int i = 0; i < ledCount; i++) {
+    if (leds[i]) next.litCount++;
+  }
+  startEffect(next);
+  res.set("OK");
+}
+
+void cmdEffectStop(char* args, Response& res) {
+  stopEffect();
+  res.set("OK");
+}
+
+// TIMELINE KEY <ms> <LINEAR|EASE|STEP> [hex] appends a keyframe `ms` after
+// the start of playback: the given frame, or the current one.
+void cmdTimelineKey(char* args, Response& res) {
+  int ms;
+  const char* easeName = nullptr;
+  KeyEase ease = KEY_LINEAR;
+  if (!nextInt(args, ms) || ms < 0 || (uint32_t)ms > MAX_EFFECT_MS || (easeName = nextToken(args)) == nullptr) {
+    res.set("ERR usage: TIMELINE KEY <ms> <LINEAR|EASE|STEP> [hex rgb payload]");
+    return;
+  }
+  if (strcasecmp(easeName, "EASE") == 0) {
+    ease = KEY_EASE;
+  } else if (strcasecmp(easeName, "STEP") == 0) {
+    ease = KEY_STEP;
+  } else if (strcasecmp(easeName, "LINEAR") != 0) {
+    res.set("ERR usage: TIMELINE KEY <ms> <LINEAR|EASE|STEP> [hex rgb payload]");
+    return;
+  }
+  if (keyframeCount == MAX_KEYFRAMES) {
+    res.format("ERR timeline holds %d keyframes", MAX_KEYFRAMES);
+    return;
+  }
+  if (keyframeCount > 0 && (uint32_t)ms <= keyframeMs[keyframeCount - 1]) {
+    res.set("ERR keyframe times must increase");
+    return;
+  }
+  CRGB* frame = keyframeLeds[keyframeCount];
+  while (isSpace(*args)) args++;
+  if (atEnd(args)) {
+    memcpy(frame, leds, frameBytes());
+  } else if (!decodeHexFrame(args, trimEnd(args, strlen(args)), frame)) {
+    res.set("ERR usage: TIMELINE KEY <ms> <LINEAR|EASE|STEP> [hex rgb payload]");
+    return;
+  }
+  keyframeMs[keyframeCount] = (uint32_t)ms;
+  keyframeEase[keyframeCount] = ease;
+  keyframeCount++;
+  res.format("OK KEY %u", keyframeCount - 1);
+}
+
+// TIMELINE PLAY [LOOP] starts from the current frame; LOOP repeats from the
+// last keyframe.
+void cmdTimelinePlay(char* args, Response& res) {
+  EffectState next;
+  next.kind = EFFECT_TIMELINE;
+  const char* mode = nextToken(args);
+  if ((mode != nullptr && strcasecmp(mode, "LOOP") != 0) || !atEnd(args)) {
+    res.set("ERR usage: TIMELINE PLAY [LOOP]");
+    return;
+  }
+  if (keyframeCount == 0) {
+    res.set("ERR timeline is empty");
+    return;
+  }
+  next.loop = mode != nullptr;
+  startEffect(next);
+  res.set("OK");
+}
+
+void cmdTimelineClear(char* args, Response& res) {
+  if (effect.kind == EFFECT_TIMELINE) stopEffect();
+  keyframeCount = 0;
+  res.set("OK");
+}
+
+void cmdTimelineList(char* args, Response& res) {
+  static const char* const EASE_NAMES[] = {"LINEAR", "EASE", "STEP"};
+  res.format("OK TIMELINE %u", keyframeCount);
+  for (uint8_t k = 0; k < keyframeCount; k++) {
+    res.append(" %lu:%s", (unsigned long)keyframeMs[k], EASE_NAMES[keyframeEase[k]]);
+  }
+  if (effect.kind == EFFECT_TIMELINE) res.append(" PLAYING");
+}
+
+void routeKey(char* key, char kind, int id) {
+  snprintf(key, 8, "%c%d", kind, id);
+}
+
+// Reads which route slots hold a valid frame, and their versions, at boot.
+void loadRouteTable() {
+  routePrefs.begin("routes", false);
+  char key[8];
+  for (int id = 0; id < MAX_ROUTES; id++) {
+    routeKey(key, 'f', id);
+    if (routePrefs.getBytesLength(key) != frameBytes()) continue;
+    routeKey(key, 'v', id);
+    routeVersions[id] = routePrefs.getUInt(key, 0);
+    routePresentMask |= 1UL << id;
+  }
+}
+
+uint16_t stateCrc(const CRGB* frame, uint8_t brightness) {
+  const uint8_t* bytes = reinterpret_cast<const uint8_t*>(frame);
+  uint16_t crc = crc16Update(0xFFFF, brightness);
+  for (size_t i = 0; i < frameBytes(); i++) crc = crc16Update(crc, bytes[i]);
+  return crc;
+}
+
+// Restores the last saved frame and brightness into leds[]; false if there
+// is none for this LED count.
+bool loadLastState() {
+  statePrefs.begin("state", false);
+  if (statePrefs.getBytesLength("frame") != frameBytes() ||
+      statePrefs.getBytes("frame", leds, frameBytes()) != frameBytes()) {
+    return false;
+  }
+  FastLED.setBrightness(statePrefs.getUChar("bright", DEFAULT_BRIGHTNESS));
+  savedStateCrc = stateCrc(leds, FastLED.getBrightness());
+  return true;
+}
+
+// Net task: saves the shown frame once it has stayed unchanged for
+// STATE_SAVE_IDLE_MS (`force`: right away), and only if it differs from the
+// stored one, so streams and effects never wear the flash. The write runs
+// without stateLock.
+void saveLastState(bool force) {
+  if (!statePending.load()) return;
+  if (!force && millis() - stateChangedMs.load() < STATE_SAVE_IDLE_MS) return;
+  uint8_t brightness;
+  {
+    StateGuard guard;
+    if (effect.kind != EFFECT_NONE) return;
+    statePending.store(false);
+    memcpy(stateScratch, leds, frameBytes());
+    brightness = FastLED.getBrightness();
+  }
+  const uint16_t crc = stateCrc(stateScratch, brightness);
+  if (crc == savedStateCrc) return;
+  if (statePrefs.putBytes("frame", stateScratch, frameBytes()) == frameBytes() &&
+      statePrefs.putUChar("bright", brightness) == 1) {
+    savedStateCrc = crc;
+  }
+}
+
+// Net task: pushes the shown frame to /events clients as a "state" event,
+// coalescing presents into at most one push per EVENT_MIN_INTERVAL_MS and
+// skipping ones that changed nothing (a repeated SHOW), so effects and
+// streams can't flood the clients. The send runs without stateLock.
+void pushShownState() {
+  if (!httpServerStarted.load() || events.count() == 0) return;
+  const uint32_t version = shownVersion.load();
+  if (version == pushedVersion && !eventsResync.load()) return;
+  if (millis() - lastEventMs < EVENT_MIN_INTERVAL_MS) return;
+  const bool resync = eventsResync.exchange(false);
+  pushedVersion = version;
+  lastEventMs = millis();
+  uint8_t brightness;
+  bool sequenced;
+  uint32_t seq;
+  {
+    StateGuard guard;
+    memcpy(eventScratch, leds, frameBytes());
+    brightness = FastLED.getBrightness();
+    sequenced = seqValid;
+    seq = lastSeq;
+  }
+  const uint16_t crc = stateCrc(eventScratch, brightness);
+  if (crc == pushedStateCrc && !resync) return;
+  pushedStateCrc = crc;
+
+  static const char HEX_DIGITS[] = "0123456789ABCDEF";
+  int n = sequenced ? snprintf(eventJson, sizeof(eventJson), "{\"version\":%lu,\"seq\":%lu,", (unsigned long)version,
+                               (unsigned long)seq)
+                    : snprintf(eventJson, sizeof(eventJson), "{\"version\":%lu,\"seq\":null,", (unsigned long)version);
+  n += snprintf(eventJson + n, sizeof(eventJson) - n, "\"brightness\":%u,\"leds\":%u,\"frame\":\"", brightness,
+                ledCount);
+  const uint8_t* rgb = reinterpret_cast<const uint8_t*>(eventScratch);
+  for (size_t i = 0; i < frameBytes(); i++) {
+    eventJson[n++] = HEX_DIGITS[rgb[i] >> 4];
+    eventJson[n++] = HEX_DIGITS[rgb[i] & 0x0F];
+  }
+  memcpy(eventJson + n, "\"}", 3);
+  events.send(eventJson, "state", version);
+}
+
+bool nextRouteId(char*& args, int& id) {
+  return nextInt(args, id) && id >= 0 && id < MAX_ROUTES;
+}
+
+void cmdRouteSave(char* args, Response& res) {
+  int id;
+  char* version = nullptr;
+  char* hex = nullptr;
+  if (!nextRouteId(args, id) || (version = nextToken(args)) == nullptr || (hex = nextToken(args)) == nullptr ||
+      !atEnd(args)) {
+    res.format("ERR usage: ROUTE SAVE <0-%d> <version hex> <frame hex>", MAX_ROUTES - 1);
+    return;
+  }
+  char* end;
+  const uint32_t ver = strtoul(version, &end, 16);
+  if (*end != '\0' || !decodeHexFrame(hex, strlen(hex), routeScratch)) {
+    res.set("ERR invalid route payload");
+    return;
+  }
+
+  char key[8];
+  routeKey(key, 'f', id);
+  if (routePrefs.putBytes(key, routeScratch, frameBytes()) != frameBytes()) {
+    res.set("ERR route storage failed");
+    return;
+  }
+  routeKey(key, 'v', id);
+  routePrefs.putUInt(key, ver);
+  routeVersions[id] = ver;
+  routePresentMask |= 1UL << id;
+  res.set("OK");
+}
+
+void cmdRouteLoad(char* args, Response& res) {
+  int id;
+  if (!nextRouteId(args, id) || !atEnd(args)) {
+    res.format("ERR usage: ROUTE LOAD <0-%d>", MAX_ROUTES - 1);
+    return;
+  }
+  if (!(routePresentMask & (1UL << id))) {
+    res.set("ERR route not stored");
+    return;
+  }
+  char key[8];
+  routeKey(key, 'f', id);
+  if (routePrefs.getBytes(key, leds, frameBytes()) != frameBytes()) {
+    res.set("ERR route storage failed");
+    return;
+  }
+  requestShow();
+  res.set("OK");
+}
+
+void cmdRouteDelete(char* args, Response& res) {
+  int id;
+  if (!nextRouteId(args, id) || !atEnd(args)) {
+    res.format("ERR usage: ROUTE DELETE <0-%d>", MAX_ROUTES - 1);
+    return;
+  }
+  char key[8];
+  routeKey(key, 'f', id);
+  routePrefs.remove(key);
+  routeKey(key, 'v', id);
+  routePrefs.remove(key);
+  routePresentMask &= ~(1UL << id);
+  res.set("OK");
+}
+
+// OK ROUTES <id>:<version hex> ...
+void cmdRouteList(char* args, Response& res) {
+  size_t len = strlcpy(res.buf, "OK ROUTES", res.cap);
+  for (int id = 0; id < MAX_ROUTES && len < res.cap; id++) {
+    if (!(routePresentMask & (1UL << id))) continue;
+    len += snprintf(res.buf + len, res.cap - len, " %d:%08lx", id, (unsigned long)routeVersions[id]);
+  }
+}
+
+const CommandEntry ROUTE_COMMANDS[] = {
+  {"SAVE", cmdRouteSave},
+  {"LOAD", cmdRouteLoad},
+  {"DELETE", cmdRouteDelete},
+  {"LIST", cmdRouteList},
+};
+
+bool isLayoutPin(int pin) {
+  switch (pin) {
+#define LAYOUT_PIN_CASE(p) case p:
+    LAYOUT_PINS(LAYOUT_PIN_CASE)
+#undef LAYOUT_PIN_CASE
+    return true;
+  }
+  return false;
+}
+
+// Parses a color order like "GRB" into wire-position -> channel indices.
+bool parseColorOrder(const char* name, uint8_t order[3]) {
+  if (strlen(name) != 3) return false;
+  uint8_t seen = 0;
+  for (int k = 0; k < 3; k++) {
+    const char c = name[k] & ~0x20;  // ASCII upper-case
+    const uint8_t channel = c == 'R' ? 0 : c == 'G' ? 1 : c == 'B' ? 2 : 3;
+    if (channel > 2 || (seen & (1 << channel))) return false;
+    seen |= 1 << channel;
+    order[k] = channel;
+  }
+  return true;
+}
+
+// Parses "<pin>:<length>:<order>".
+bool parseStrip(char* tok, StripConfig& strip) {
+  char* end;
+  const long pin = strtol(tok, &end, 10);
+  if (end == tok || *end != ':') return false;
+  char* lengthTok = end + 1;
+  const long length = strtol(lengthTok, &end, 10);
+  if (end == lengthTok || *end != ':') return false;
+  if (!isLayoutPin(pin) || length < 1 || length > MAX_LEDS) return false;
+  if (!parseColorOrder(end + 1, strip.order)) return false;
+  strip.pin = (uint8_t)pin;
+  strip.length = (uint16_t)length;
+  return true;
+}
+
+void formatLayout(const StripConfig* strips, uint8_t count, Response& res) {
+  static const char CHANNELS[] = "RGB";
+  size_t len = strlcpy(res.buf, "OK LAYOUT", res.cap);
+  for (uint8_t s = 0; s < count && len < res.cap; s++) {
+    const StripConfig& strip = strips[s];
+    len += snprintf(res.buf + len, res.cap - len, " %u:%u:%c%c%c", strip.pin, strip.length,
+                    CHANNELS[strip.order[0]], CHANNELS[strip.order[1]], CHANNELS[strip.order[2]]);
+  }
+}
+
+// Reads the stored layout, falling back to one NUM_LEDS strip on DATA_PIN.
+void loadLayout() {
+  layoutPrefs.begin("layout", false);
+  const uint8_t count = layoutPrefs.getUChar("count", 0);
+  stripCount = 0;
+  ledCount = 0;
+  if (count > 0 && count <= MAX_STRIPS &&
+      layoutPrefs.getBytes("strips", layout, sizeof(StripConfig) * count) == sizeof(StripConfig) * count) {
+    uint32_t total = 0;
+    bool valid = true;
+    for (uint8_t s = 0; s < count; s++) {
+      valid = valid && isLayoutPin(layout[s].pin) && layout[s].length > 0;
+      total += layout[s].length;
+    }
+    if (valid && total <= MAX_LEDS) {
+      stripCount = count;
+      ledCount = (uint16_t)total;
+      return;
+    }
+  }
+
+  layout[0].pin = DATA_PIN;
+  layout[0].length = NUM_LEDS;
+  parseColorOrder(COLOR_ORDER, layout[0].order);
+  stripCount = 1;
+  ledCount = NUM_LEDS;
+}
+
+// Registers one FastLED controller per strip on consecutive slices of the
+// front buffer.
+void addStripControllers() {
+  uint16_t offset = 0;
+  for (uint8_t s = 0; s < stripCount; s++) {
+    CRGB* data = frontLeds + offset;
+    const uint16_t length = layout[s].length;
+    switch (layout[s].pin) {
+#define ADD_STRIP_CASE(p)                                 \
+  case p:                                                 \
+    FastLED.addLeds<LED_TYPE, p, RGB>(data, length);      \
+    break;
+      LAYOUT_PINS(ADD_STRIP_CASE)
+#undef ADD_STRIP_CASE
+    }
+    offset += length;
+  }
+}
+
+void cmdLayoutGet(char* args, Response& res) {
+  formatLayout(layout, stripCount, res);
+}
+
+// LAYOUT SET <pin>:<length>:<order> [...]: stored now, applied after RESTART.
+void cmdLayoutSet(char* args, Response& res) {
+  StripConfig strips[MAX_STRIPS];
+  uint8_t count = 0;
+  uint32_t total = 0;
+  while (char* tok = nextToken(args)) {
+    if (count >= MAX_STRIPS || !parseStrip(tok, strips[count])) {
+      res.format("ERR usage: LAYOUT SET <pin>:<length>:<order> [...] (max %d strips, one per RMT channel)", MAX_STRIPS);
+      return;
+    }
+    total += strips[count].length;
+    count++;
+  }
+  if (count == 0) {
+    res.format("ERR usage: LAYOUT SET <pin>:<length>:<order> [...] (max %d strips, one per RMT channel)", MAX_STRIPS);
+    return;
+  }
+  if (total > MAX_LEDS) {
+    res.format("ERR layout exceeds %d LEDs", MAX_LEDS);
+    return;
+  }
+  for (uint8_t a = 0; a < count; a++) {
+    for (uint8_t b = a + 1; b < count; b++) {
+      if (strips[a].pin == strips[b].pin) {
+        res.set("ERR duplicate strip pin");
+        return;
+      }
+    }
+  }
+
+  if (layoutPrefs.putBytes("strips", strips, sizeof(StripConfig) * count) != sizeof(StripConfig) * count ||
+      layoutPrefs.putUChar("count", count) != 1) {
+    res.set("ERR layout storage failed");
+    return;
+  }
+  formatLayout(strips, count, res);
+  strlcat(res.buf, " (RESTART to apply)", res.cap);
+}
+
+void cmdLayoutReset(char* args, Response& res) {
+  layoutPrefs.remove("strips");
+  layoutPrefs.remove("count");
+  res.set("OK (RESTART to apply)");
+}
+
+void cmdRestart(char* args, Response& res) {
+  restartAtMs = millis() + RESTART_DELAY_MS;  // let the reply go out first
+  if (restartAtMs == 0) restartAtMs = 1;
+  res.set("OK");
+}
+
+const CommandEntry LAYOUT_COMMANDS[] = {
+  {"GET", cmdLayoutGet},
+  {"SET", cmdLayoutSet},
+  {"RESET", cmdLayoutReset},
+};
+
+void cmdLayout(char* args, Response& res) {
+  if (atEnd(args)) {
+    cmdLayoutGet(args, res);
+    return;
+  }
+  if (!dispatchCommand(LAYOUT_COMMANDS, sizeof(LAYOUT_COMMANDS) / sizeof(LAYOUT_COMMANDS[0]), args, res)) {
+    res.set("ERR usage: LAYOUT [GET|SET|RESET] ...");
+  }
+}
+
+// ---- Holds ----
+
+// Builds the hold table from the grid: hold row * cols + col gets
+// ledsPerHold consecutive LEDs at its wiring position. Replaces any GRID MAP.
+void buildHoldTable() {
+  holdCount = grid.cols * grid.rows;
+  for (uint16_t row = 0; row < grid.rows; row++) {
+    for (uint16_t col = 0; col < grid.cols; col++) {
+      const uint16_t hold = row * grid.cols + col;
+      holdFirst[hold] = gridWiringPosition(grid, col, row) * ledsPerHold;
+      holdLen[hold] = ledsPerHold;
+    }
+  }
+}
+
+bool holdTableFits(const GridGeometry& g, uint8_t perHold) {
+  const uint32_t holds = (uint32_t)g.cols * g.rows;
+  return g.cols > 0 && g.rows > 0 && holds <= MAX_HOLDS && perHold > 0 && holds * perHold <= ledCount;
+}
+
+// The grid used without a stored one: a single row in wiring order, one LED
+// per hold. Hold ids are capped at MAX_HOLDS to keep the table small, so
+// longer layouts get as few LEDs per hold as reach the whole strip, and the
+// last hold also takes any remainder.
+void buildDefaultHoldTable() {
+  grid = GridGeometry();
+  ledsPerHold = (uint8_t)((ledCount + MAX_HOLDS - 1) / MAX_HOLDS);
+  grid.cols = ledCount / ledsPerHold;
+  buildHoldTable();
+  holdLen[holdCount - 1] += ledCount - holdCount * ledsPerHold;
+}
+
+void loadHoldTable() {
+  ledsPerHold = holdPrefs.getUChar("per", 1);
+  const bool stored =
+      holdPrefs.getBytes("grid", &grid, sizeof(grid)) == sizeof(grid) && holdTableFits(grid, ledsPerHold);
+  if (stored) {
+    buildHoldTable();
+  } else {
+    buildDefaultHoldTable();
+  }
+  if (holdPrefs.getBytesLength("first") == holdCount * sizeof(holdFirst[0]) &&
+      holdPrefs.getBytesLength("len") == holdCount * sizeof(holdLen[0])) {
+    holdPrefs.getBytes("first", holdFirst, holdCount * sizeof(holdFirst[0]));
+    holdPrefs.getBytes("len", holdLen, holdCount * sizeof(holdLen[0]));
+    for (uint16_t h = 0; h < holdCount; h++) {
+      if (holdFirst[h] + holdLen[h] > ledCount) {
+        if (stored) {
+          buildHoldTable();
+        } else {
+          buildDefaultHoldTable();
+        }
+        break;
+      }
+    }
+  }
+}
+
+void loadHolds() {
+  holdPrefs.begin("holds", false);
+  loadHoldTable();
+  if (holdPrefs.getBytes("regions", regions, sizeof(regions)) != sizeof(regions)) {
+    memset(regions, 0, sizeof(regions));
+  }
+  for (HoldRegion& region : regions) region.name[MAX_REGION_NAME_CHARS] = '\0';
+}
+
+bool saveHoldTable() {
+  return holdPrefs.putBytes("first", holdFirst, holdCount * sizeof(holdFirst[0])) ==
+             holdCount * sizeof(holdFirst[0]) &&
+         holdPrefs.putBytes("len", holdLen, holdCount * sizeof(holdLen[0])) == holdCount * sizeof(holdLen[0]);
+}
+
+int findRegion(const char* name) {
+  for (int i = 0; i < MAX_REGIONS; i++) {
+    if (regions[i].name[0] != '\0' && strcasecmp(regions[i].name, name) == 0) return i;
+  }
+  return -1;
+}
+
+bool isRegionName(const char* tok) {
+  const size_t len = strlen(tok);
+  if (len == 0 || len > MAX_REGION_NAME_CHARS || !isalpha((unsigned char)tok[0])) return false;
+  for (const char* c = tok; *c != '\0'; c++) {
+    if (!isalnum((unsigned char)*c) && *c != '_' && *c != '-') return false;
+  }
+  return true;
+}
+
+// A hold id, a grid cell "<col>,<row>", a rectangle "<col>,<row>:<col>,<row>"
+// or a region name.
+struct HoldSpec {
+  enum Kind : uint8_t { ONE, CELLS, REGION } kind;
+  uint16_t id;  // ONE: hold, REGION: regions[] index
+  GridRect rect;
+};
+
+bool parseHoldSpec(const char* tok, HoldSpec& spec) {
+  if (isalpha((unsigned char)tok[0])) {
+    const int region = findRegion(tok);
+    spec.kind = HoldSpec::REGION;
+    spec.id = (uint16_t)region;
+    return region >= 0;
+  }
+  if (strchr(tok, ',') != nullptr) {
+    spec.kind = HoldSpec::CELLS;
+    return parseGridRect(tok, spec.rect) && spec.rect.col1 < grid.cols && spec.rect.row1 < grid.rows;
+  }
+  uint32_t hold;
+  if (!parseSeq(tok, hold) || hold >= holdCount) return false;
+  spec.kind = HoldSpec::ONE;
+  spec.id = (uint16_t)hold;
+  return true;
+}
+
+template <typename Fn>
+void forEachHold(const HoldSpec& spec, Fn fn) {
+  switch (spec.kind) {
+    case HoldSpec::ONE:
+      fn(spec.id);
+      break;
+    case HoldSpec::CELLS:
+      for (uint16_t row = spec.rect.row0; row <= spec.rect.row1; row++) {
+        for (uint16_t col = spec.rect.col0; col <= spec.rect.col1; col++) fn(row * grid.cols + col);
+      }
+      break;
+    case HoldSpec::REGION:
+      for (uint16_t h = 0; h < holdCount; h++) {
+        if (regions[spec.id].holds[h / 8] & (1 << (h % 8))) fn(h);
+      }
+      break;
+  }
+}
+
+struct HoldRun {
+  HoldSpec spec;
+  CRGB color;
+};
+
+HoldRun holdRuns[MAX_HOLD_RUNS];
+
+// HOLD <hold|col,row|col,row:col,row|region> <r> <g> <b> [...]: SETMANY for
+// holds, expanded through the hold table. Validated before any pixel changes.
+void cmdHold(char* args, Response& res) {
+  size_t count = 0;
+  while (!atEnd(args)) {
+    if (count >= MAX_HOLD_RUNS) {
+      res.set("ERR too many runs");
+      return;
+    }
+    HoldRun& run = holdRuns[count];
+    char* tok = nextToken(args);
+    int r, g, b;
+    if (!nextInt(args, r) || !nextInt(args, g) || !nextInt(args, b)) {
+      res.set("ERR usage: HOLD <hold|col,row|col,row:col,row|region> <r> <g> <b> [...]");
+      return;
+    }
+    if (!parseHoldSpec(tok, run.spec)) {
+      res.set("ERR unknown hold");
+      return;
+    }
+    run.color = CRGB(clamp8(r), clamp8(g), clamp8(b));
+    count++;
+  }
+  if (count == 0) {
+    res.set("ERR usage: HOLD <hold|col,row|col,row:col,row|region> <r> <g> <b> [...]");
+    return;
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    const CRGB color = holdRuns[i].color;
+    forEachHold(holdRuns[i].spec, [color](uint16_t h) { fill_solid(leds + holdFirst[h], holdLen[h], color); });
+  }
+  requestShow();
+  res.set("OK");
+}
+
+// OK GRID <cols> <rows> ROWS|COLS TL|TR|BL|BR LINEAR|SERPENTINE <leds per hold>,
+// or with a hold: OK HOLD <hold> <first led> <count>.
+void cmdGridGet(char* args, Response& res) {
+  if (atEnd(args)) {
+    res.format("OK GRID %u %u %s %c%c %s %u", grid.cols, grid.rows, grid.columnMajor ? "COLS" : "ROWS",
+               grid.startBottom ? 'B' : 'T', grid.startRight ? 'R' : 'L', grid.serpentine ? "SERPENTINE" : "LINEAR",
+               ledsPerHold);
+    return;
+  }
+  char* tok = nextToken(args);
+  HoldSpec spec;
+  if (!atEnd(args) || !parseHoldSpec(tok, spec) || spec.kind == HoldSpec::REGION ||
+      (spec.kind == HoldSpec::CELLS && (spec.rect.col0 != spec.rect.col1 || spec.rect.row0 != spec.rect.row1))) {
+    res.set("ERR usage: GRID GET [<hold|col,row>]");
+    return;
+  }
+  forEachHold(spec, [&res](uint16_t h) { res.format("OK HOLD %u %u %u", h, holdFirst[h], holdLen[h]); });
+}
+
+// GRID SET <cols> <rows> ROWS|COLS TL|TR|BL|BR LINEAR|SERPENTINE [<leds per hold>]
+void cmdGridSet(char* args, Response& res) {
+  int cols, rows, perHold = 1;
+  char* major = nullptr;
+  char* corner = nullptr;
+  char* wiring = nullptr;
+  GridGeometry g;
+  if (!nextInt(args, cols) || !nextInt(args, rows) || (major = nextToken(args)) == nullptr ||
+      (corner = nextToken(args)) == nullptr || (wiring = nextToken(args)) == nullptr ||
+      (!atEnd(args) && !nextInt(args, perHold)) || !atEnd(args) || cols < 1 || rows < 1 || perHold < 1 ||
+      perHold > 255 || (strcasecmp(major, "ROWS") != 0 && strcasecmp(major, "COLS") != 0) || strlen(corner) != 2 ||
+      (strcasecmp(wiring, "LINEAR") != 0 && strcasecmp(wiring, "SERPENTINE") != 0)) {
+    res.set("ERR usage: GRID SET <cols> <rows> ROWS|COLS TL|TR|BL|BR LINEAR|SERPENTINE [<leds per hold>]");
+    return;
+  }
+  const char v = corner[0] & ~0x20;  // ASCII upper-case
+  const char h = corner[1] & ~0x20;
+  if ((v != 'T' && v != 'B') || (h != 'L' && h != 'R')) {
+    res.set("ERR usage: GRID SET <cols> <rows> ROWS|COLS TL|TR|BL|BR LINEAR|SERPENTINE [<leds per hold>]");
+    return;
+  }
+  g.cols = (uint16_t)(cols < 0xFFFF ? cols : 0xFFFF);
+  g.rows = (uint16_t)(rows < 0xFFFF ? rows : 0xFFFF);
+  g.columnMajor = strcasecmp(major, "COLS") == 0;
+  g.startBottom = v == 'B';
+  g.startRight = h == 'R';
+  g.serpentine = strcasecmp(wiring, "SERPENTINE") == 0;
+  if ((uint32_t)g.cols * g.rows > MAX_HOLDS) {
+    res.format("ERR grid exceeds %d holds", MAX_HOLDS);
+    return;
+  }
+  if (!holdTableFits(g, (uint8_t)perHold)) {
+    res.format("ERR grid needs more than %u LEDs", ledCount);
+    return;
+  }
+
+  grid = g;
+  ledsPerHold = (uint8_t)perHold;
+  buildHoldTable();
+  holdPrefs.remove("first");
+  holdPrefs.remove("len");
+  if (holdPrefs.putBytes("grid", &grid, sizeof(grid)) != sizeof(grid) || holdPrefs.putUChar("per", ledsPerHold) != 1) {
+    res.set("ERR grid storage failed");
+    return;
+  }
+  cmdGridGet(args, res);
+}
+
+// GRID MAP <hold|col,row> <first led> [<count>]: rewires one hold, e.g. a
+// volume with more LEDs than the rest. GRID SET rebuilds the whole table.
+void cmdGridMap(char* args, Response& res) {
+  char* tok = nextToken(args);
+  int first, count = ledsPerHold;
+  HoldSpec spec;
+  if (tok == nullptr || !nextInt(args, first) || (!atEnd(args) && !nextInt(args, count)) || !atEnd(args) ||
+      !parseHoldSpec(tok, spec) || spec.kind == HoldSpec::REGION ||
+      (spec.kind == HoldSpec::CELLS && (spec.rect.col0 != spec.rect.col1 || spec.rect.row0 != spec.rect.row1))) {
+    res.set("ERR usage: GRID MAP <hold|col,row> <first led> [<count>]");
+    return;
+  }
+  if (first < 0 || count < 0 || count > 255 || first + count > ledCount) {
+    res.set("ERR index out of range");
+    return;
+  }
+  uint16_t hold = 0;
+  forEachHold(spec, [&hold](uint16_t h) { hold = h; });
+  holdFirst[hold] = (uint16_t)first;
+  holdLen[hold] = (uint8_t)count;
+  if (!saveHoldTable()) {
+    res.set("ERR grid storage failed");
+    return;
+  }
+  res.format("OK HOLD %u %u %u", hold, holdFirst[hold], holdLen[hold]);
+}
+
+void cmdGridReset(char* args, Response& res) {
+  holdPrefs.remove("grid");
+  holdPrefs.remove("per");
+  holdPrefs.remove("first");
+  holdPrefs.remove("len");
+  loadHoldTable();
+  cmdGridGet(args, res);
+}
+
+const CommandEntry GRID_COMMANDS[] = {
+  {"GET", cmdGridGet},
+  {"SET", cmdGridSet},
+  {"MAP", cmdGridMap},
+  {"RESET", cmdGridReset},
+};
+
+void cmdGrid(char* args, Response& res) {
+  if (atEnd(args)) {
+    cmdGridGet(args, res);
+    return;
+  }
+  if (!dispatchCommand(GRID_COMMANDS, sizeof(GRID_COMMANDS) / sizeof(GRID_COMMANDS[0]), args, res)) {
+    res.set("ERR usage: GRID [GET|SET|MAP|RESET] ...");
+  }
+}
+
+// REGION SET <name> <hold|col,row|col,row:col,row|region> [...]
+void cmdRegionSet(char* args, Response& res) {
+  char* name = nextToken(args);
+  if (name == nullptr || !isRegionName(name) || atEnd(args)) {
+    res.format("ERR usage: REGION SET <name> <hold|col,row|col,row:col,row|region> [...] (name: max %d chars)",
+               MAX_REGION_NAME_CHARS);
+    return;
+  }
+  HoldRegion region = {};
+  strlcpy(region.name, name, sizeof(region.name));
+  while (char* tok = nextToken(args)) {
+    HoldSpec spec;
+    if (!parseHoldSpec(tok, spec)) {
+      res.set("ERR unknown hold");
+      return;
+    }
+    forEachHold(spec, [&region](uint16_t h) { region.holds[h / 8] |= 1 << (h % 8); });
+  }
+  int slot = findRegion(name);
+  for (int i = 0; i < MAX_REGIONS && slot < 0; i++) {
+    if (regions[i].name[0] == '\0') slot = i;
+  }
+  if (slot < 0) {
+    res.format("ERR max %d regions", MAX_REGIONS);
+    return;
+  }
+  regions[slot] = region;
+  if (holdPrefs.putBytes("regions", regions, sizeof(regions)) != sizeof(regions)) {
+    res.set("ERR region storage failed");
+    return;
+  }
+  res.set("OK");
+}
+
+// OK REGION <name> <hold> ...
+void cmdRegionGet(char* args, Response& res) {
+  char* name = nextToken(args);
+  const int slot = name != nullptr && atEnd(args) ? findRegion(name) : -1;
+  if (slot < 0) {
+    res.set("ERR usage: REGION GET <name>");
+    return;
+  }
+  size_t len = snprintf(res.buf, res.cap, "OK REGION %s", regions[slot].name);
+  HoldSpec spec;
+  spec.kind = HoldSpec::REGION;
+  spec.id = (uint16_t)slot;
+  forEachHold(spec, [&](uint16_t h) {
+    if (len < res.cap) len += snprintf(res.buf + len, res.cap - len, " %u", h);
+  });
+}
+
+void cmdRegionDelete(char* args, Response& res) {
+  char* name = nextToken(args);
+  const int slot = name != nullptr && atEnd(args) ? findRegion(name) : -1;
+  if (slot < 0) {
+    res.set("ERR usage: REGION DELETE <name>");
+    return;
+  }
+  memset(&regions[slot], 0, sizeof(regions[slot]));
+  if (holdPrefs.putBytes("regions", regions, sizeof(regions)) != sizeof(regions)) {
+    res.set("ERR region storage failed");
+    return;
+  }
+  res.set("OK");
+}
+
+// OK REGIONS <name> ...
+void cmdRegionList(char* args, Response& res) {
+  size_t len = strlcpy(res.buf, "OK REGIONS", res.cap);
+  for (int i = 0; i < MAX_REGIONS && len < res.cap; i++) {
+    if (regions[i].name[0] == '\0') continue;
+    len += snprintf(res.buf + len, res.cap - len, " %s", regions[i].name);
+  }
+}
+
+const CommandEntry REGION_COMMANDS[] = {
+  {"SET", cmdRegionSet},
+  {"GET", cmdRegionGet},
+  {"DELETE", cmdRegionDelete},
+  {"LIST", cmdRegionList},
+};
+
+void cmdRegion(char* args, Response& res) {
+  if (!dispatchCommand(REGION_COMMANDS, sizeof(REGION_COMMANDS) / sizeof(REGION_COMMANDS[0]), args, res)) {
+    res.set("ERR usage: REGION SET|GET|DELETE|LIST ...");
+  }
+}
+
+const CommandEntry EFFECT_COMMANDS[] = {
+  {"FADE", cmdEffectFade},
+  {"PULSE", cmdEffectPulse},
+  {"CHASE", cmdEffectChase},
+  {"REVEAL", cmdEffectReveal},
+  {"STOP", cmdEffectStop},
+};
+
+void cmdEffect(char* args, Response& res) {
+  if (!dispatchCommand(EFFECT_COMMANDS, sizeof(EFFECT_COMMANDS) / sizeof(EFFECT_COMMANDS[0]), args, res)) {
+    res.set("ERR usage: EFFECT FADE|PULSE|CHASE|REVEAL|STOP ...");
+  }
+}
+
+const CommandEntry TIMELINE_COMMANDS[] = {
+  {"KEY", cmdTimelineKey},
+  {"PLAY", cmdTimelinePlay},
+  {"STOP", cmdEffectStop},
+  {"CLEAR", cmdTimelineClear},
+  {"LIST", cmdTimelineList},
+};
+
+void cmdTimeline(char* args, Response& res) {
+  if (atEnd(args)) {
+    cmdTimelineList(args, res);
+    return;
+  }
+  if (!dispatchCommand(TIMELINE_COMMANDS, sizeof(TIMELINE_COMMANDS) / sizeof(TIMELINE_COMMANDS[0]), args, res)) {
+    res.set("ERR usage: TIMELINE KEY|PLAY|STOP|CLEAR|LIST ...");
+  }
+}
+
+void cmdRoute(char* args, Response& res) {
+  if (!dispatchCommand(ROUTE_COMMANDS, sizeof(ROUTE_COMMANDS) / sizeof(ROUTE_COMMANDS[0]), args, res)) {
+    res.set("ERR usage: ROUTE SAVE|LOAD|DELETE|LIST ...");
+  }
+}
+
+// BAUD <rate> acknowledges at the current rate; the serial task switches once
+// the reply has been written. Resets to SERIAL_BAUD on reboot.
+void cmdBaud(char* args, Response& res) {
+  if (atEnd(args)) {
+    res.format("OK BAUD %lu", (unsigned long)serialBaud);
+    return;
+  }
+  int baud;
+  if (!nextInt(args, baud) || !atEnd(args) || baud < SERIAL_BAUD_MIN || baud > SERIAL_BAUD_MAX) {
+    res.format("ERR usage: BAUD <%d-%d>", SERIAL_BAUD_MIN, SERIAL_BAUD_MAX);
+    return;
+  }
+  if (SERIAL_USB_CDC) {
+    res.set("ERR BAUD unsupported on USB CDC");
+    return;
+  }
+  pendingBaud.store((uint32_t)baud);
+  res.format("OK BAUD %d", baud);
+}
+
+void rebuildOutputLuts() {
+  for (uint8_t c = 0; c < 3; c++) {
+    buildOutputLut(outputLut[c], output.gammaX100 / 100.0f, output.scale[c]);
+  }
+}
+
+// Reads the stored gamma, calibration and power budget; defaults are linear
+// and unlimited.
+void loadOutputConfig() {
+  outputPrefs.begin("output", false);
+  const uint16_t gamma = outputPrefs.getUShort("gamma", DEFAULT_GAMMA_X100);
+  if (gamma >= GAMMA_MIN_X100 && gamma <= GAMMA_MAX_X100) output.gammaX100 = gamma;
+  uint8_t scale[3];
+  if (outputPrefs.getBytes("scale", scale, sizeof(scale)) == sizeof(scale)) memcpy(output.scale, scale, sizeof(scale));
+  const uint32_t power = outputPrefs.getUInt("power", DEFAULT_POWER_LIMIT_MA);
+  if (power <= MAX_POWER_LIMIT_MA) output.powerLimitMa = power;
+  rebuildOutputLuts();
+}
+
+// Decimal gamma such as 2.2, stored in hundredths.
+bool parseGamma(const char* tok, uint16_t& x100) {
+  char* end;
+  const float g = strtof(tok, &end);
+  if (end == tok || *end != '\0') return false;
+  const long v = lroundf(g * 100);
+  if (v < GAMMA_MIN_X100 || v > GAMMA_MAX_X100) return false;
+  x100 = (uint16_t)v;
+  return true;
+}
+
+// GAMMA <1.0-3.0> [<r> <g> <b>] sets the output curve and, optionally, each
+// channel's full-scale level for white balance. Stored across reboots.
+void cmdGamma(char* args, Response& res) {
+  if (atEnd(args)) {
+    res.format("OK GAMMA %u.%02u CAL %u %u %u", output.gammaX100 / 100, output.gammaX100 % 100, output.scale[0],
+               output.scale[1], output.scale[2]);
+    return;
+  }
+  uint16_t gamma;
+  int cal[3] = {output.scale[0], output.scale[1], output.scale[2]};
+  char* tok = nextToken(args);
+  if (!parseGamma(tok, gamma) ||
+      (!atEnd(args) && (!nextInt(args, cal[0]) || !nextInt(args, cal[1]) || !nextInt(args, cal[2]))) ||
+      !atEnd(args)) {
+    res.set("ERR usage: GAMMA <1.0-3.0> [<r> <g> <b>]");
+    return;
+  }
+  output.gammaX100 = gamma;
+  for (uint8_t c = 0; c < 3; c++) output.scale[c] = (uint8_t)clamp8(cal[c]);
+  rebuildOutputLuts();
+  markDirty();
+  if (outputPrefs.putUShort("gamma", output.gammaX100) != sizeof(uint16_t) ||
+      outputPrefs.putBytes("scale", output.scale, sizeof(output.scale)) != sizeof(output.scale)) {
+    res.set("ERR output storage failed");
+    return;
+  }
+  res.set("OK");
+}
+
+// POWER <mA> caps the estimated strip current by lowering the brightness of
+// frames that would exceed it; 0 removes the cap. POWER alone reports the
+// cap, the last frame's estimated draw and the brightness it was shown at.
+void cmdPower(char* args, Response& res) {
+  if (atEnd(args)) {
+    res.format("OK POWER %lu EST %lu BRIGHT %u", (unsigned long)output.powerLimitMa,
+               (unsigned long)estimateCurrentMa(frameLoad, ledCount, shownBrightness), shownBrightness);
+    return;
+  }
+  int ma;
+  if (!nextInt(args, ma) || !atEnd(args) || ma < 0 || ma > MAX_POWER_LIMIT_MA) {
+    res.format("ERR usage: POWER <0-%d mA>", MAX_POWER_LIMIT_MA);
+    return;
+  }
+  output.powerLimitMa = (uint32_t)ma;
+  markDirty();
+  if (outputPrefs.putUInt("power", output.powerLimitMa) != sizeof(uint32_t)) {
+    res.set("ERR output storage failed");
+    return;
+  }
+  res.set("OK");
+}
+
+void loadWifiConfig() {
+  wifiPrefs.begin("wifi", false);
+  wifiConfig.sleep = wifiPrefs.getBool("sleep", false);
+  const uint8_t tx = wifiPrefs.getUChar("txpower", 0);
+  if (tx == 0 || (tx >= WIFI_TX_POWER_MIN_DBM * 4 && tx <= WIFI_TX_POWER_MAX_DBM * 4)) wifiConfig.txPowerQdBm = tx;
+  if (wifiPrefs.getBytes("bssid", wifiConfig.bssid, sizeof(wifiConfig.bssid)) == sizeof(wifiConfig.bssid)) {
+    wifiConfig.channel = wifiPrefs.getUChar("channel", 0);
+  }
+  if (wifiPrefs.getBytes("ip", wifiConfig.ip, sizeof(wifiConfig.ip)) != sizeof(wifiConfig.ip)) {
+    memset(wifiConfig.ip, 0, sizeof(wifiConfig.ip));
+  }
+}
+
+// Sleep and TX power take effect at once; both need the radio started.
+void applyWifiRadio() {
+  WiFi.setSleep(wifiConfig.sleep);
+  if (wifiConfig.txPowerQdBm != 0) WiFi.setTxPower((wifi_power_t)wifiConfig.txPowerQdBm);
+}
+
+void appendIp(Response& res, const char* name, uint32_t v) {
+  const IPAddress ip(v);
+  res.append(" %s %u.%u.%u.%u", name, ip[0], ip[1], ip[2], ip[3]);
+}
+
+void cmdWifiGet(char* args, Response& res) {
+  const WifiConfig& c = wifiConfig;
+  res.format("OK WIFI SLEEP %s TXPOWER %u", c.sleep ? "ON" : "OFF", c.txPowerQdBm / 4);
+  if (c.channel != 0) {
+    res.append(" LOCK %u:%02X:%02X:%02X:%02X:%02X:%02X", c.channel, c.bssid[0], c.bssid[1], c.bssid[2], c.bssid[3],
+               c.bssid[4], c.bssid[5]);
+  } else {
+    res.append(" LOCK NONE");
+  }
+  if (c.ip[0] != 0) {
+    appendIp(res, "IP", c.ip[0]);
+    appendIp(res, "GW", c.ip[1]);
+    appendIp(res, "MASK", c.ip[2]);
+    appendIp(res, "DNS", c.ip[3]);
+  } else {
+    res.append(" IP DHCP");
+  }
+  if (WiFi.status() == WL_CONNECTED) {
+    res.append(" CHANNEL %d RSSI %d", (int)WiFi.channel(), (int)WiFi.RSSI());
+  }
+}
+
+void cmdWifiSleep(char* args, Response& res) {
+  const char* mode = nextToken(args);
+  if (mode == nullptr || !atEnd(args) || (strcasecmp(mode, "ON") != 0 && strcasecmp(mode, "OFF") != 0)) {
+    res.set("ERR usage: WIFI SLEEP ON|OFF");
+    return;
+  }
+  wifiConfig.sleep = strcasecmp(mode, "ON") == 0;
+  applyWifiRadio();
+  if (wifiPrefs.putBool("sleep", wifiConfig.sleep) != 1) {
+    res.set("ERR wifi storage failed");
+    return;
+  }
+  res.set("OK");
+}
+
+// TXPOWER 0 returns to the default on the next connect.
+void cmdWifiTxPower(char* args, Response& res) {
+  int dbm;
+  if (!nextInt(args, dbm) || !atEnd(args) ||
+      (dbm != 0 && (dbm < WIFI_TX_POWER_MIN_DBM || dbm > WIFI_TX_POWER_MAX_DBM))) {
+    res.format("ERR usage: WIFI TXPOWER <%d-%d dBm | 0>", WIFI_TX_POWER_MIN_DBM, WIFI_TX_POWER_MAX_DBM);
+    return;
+  }
+  wifiConfig.txPowerQdBm = (uint8_t)(dbm * 4);
+  applyWifiRadio();
+  if (wifiPrefs.putUChar("txpower", wifiConfig.txPowerQdBm) != 1) {
+    res.set("ERR wifi storage failed");
+    return;
+  }
+  res.set("OK");
+}
+
+// LOCK pins the current access point and channel, so reconnects skip the
+// scan; UNLOCK scans again.
+void cmdWifiLock(char* args, Response& res) {
+  const uint8_t* bssid = WiFi.BSSID();
+  if (WiFi.status() != WL_CONNECTED || bssid == nullptr) {
+    res.set("ERR wifi not connected");
+    return;
+  }
+  wifiConfig.channel = (uint8_t)WiFi.channel();
+  memcpy(wifiConfig.bssid, bssid, sizeof(wifiConfig.bssid));
+  if (wifiPrefs.putBytes("bssid", wifiConfig.bssid, sizeof(wifiConfig.bssid)) != sizeof(wifiConfig.bssid) ||
+      wifiPrefs.putUChar("channel", wifiConfig.channel) != 1) {
+    res.set("ERR wifi storage failed");
+    return;
+  }
+  cmdWifiGet(args, res);
+}
+
+void cmdWifiUnlock(char* args, Response& res) {
+  wifiConfig.channel = 0;
+  wifiPrefs.remove("channel");
+  wifiPrefs.remove("bssid");
+  res.set("OK");
+}
+
+// IP <address> <gateway> <mask> [dns] sets a static address, skipping DHCP on
+// every connect; IP DHCP goes back. Applied on the next connect.
+void cmdWifiIp(char* args, Response& res) {
+  uint32_t ip[4] = {};
+  const char* tok = nextToken(args);
+  if (tok != nullptr && strcasecmp(tok, "DHCP") == 0 && atEnd(args)) {
+    memset(wifiConfig.ip, 0, sizeof(wifiConfig.ip));
+    wifiPrefs.remove("ip");
+    res.set("OK");
+    return;
+  }
+  int n = 0;
+  for (; tok != nullptr && n < 4; tok = nextToken(args), n++) {
+    IPAddress addr;
+    if (!addr.fromString(tok)) break;
+    ip[n] = (uint32_t)addr;
+  }
+  if (tok != nullptr || n < 3 || ip[0] == 0) {
+    res.set("ERR usage: WIFI IP DHCP | WIFI IP <address> <gateway> <mask> [dns]");
+    return;
+  }
+  if (n == 3) ip[3] = ip[1];  // DNS on the gateway
+  memcpy(wifiConfig.ip, ip, sizeof(ip));
+  if (wifiPrefs.putBytes("ip", wifiConfig.ip, sizeof(wifiConfig.ip)) != sizeof(wifiConfig.ip)) {
+    res.set("ERR wifi storage failed");
+    return;
+  }
+  res.set("OK");
+}
+
+void cmdWifiReconnect(char* args, Response& res) {
+  wifiReconnectPending.store(true);
+  res.set("OK");
+}
+
+// Sleep goes back to off at once; the lock, static IP and default TX power
+// need a fresh connect, so RESET reconnects like WIFI RECONNECT.
+void cmdWifiReset(char* args, Response& res) {
+  wifiConfig = WifiConfig();
+  wifiPrefs.clear();
+  applyWifiRadio();
+  wifiReconnectPending.store(true);
+  res.set("OK");
+}
+
+const CommandEntry WIFI_COMMANDS[] = {
+  {"GET", cmdWifiGet},
+  {"SLEEP", cmdWifiSleep},
+  {"TXPOWER", cmdWifiTxPower},
+  {"LOCK", cmdWifiLock},
+  {"UNLOCK", cmdWifiUnlock},
+  {"IP", cmdWifiIp},
+  {"RECONNECT", cmdWifiReconnect},
+  {"RESET", cmdWifiReset},
+};
+
+void cmdWifi(char* args, Response& res) {
+  if (atEnd(args)) {
+    cmdWifiGet(args, res);
+    return;
+  }
+  if (!dispatchCommand(WIFI_COMMANDS, sizeof(WIFI_COMMANDS) / sizeof(WIFI_COMMANDS[0]), args, res)) {
+    res.set("ERR usage: WIFI [GET|SLEEP|TXPOWER|LOCK|UNLOCK|IP|RECONNECT|RESET] ...");
+  }
+}
+
+void appendLatency(Response& res, const char* name, const LatencyStat& st) {
+  res.append(" %s_us=%lu/%lu/%lu/%lu", name, (unsigned long)st.count,
+             (unsigned long)(st.count ? st.totalUs / st.count : 0), (unsigned long)latencyPercentile(st, 99),
+             (unsigned long)st.maxUs);
+}
+
+void printLatencyJson(Print& out, const char* name, const LatencyStat& st) {
+  out.printf("\"%s\":{\"count\":%lu,\"avg_us\":%lu,\"p50_us\":%lu,\"p99_us\":%lu,\"max_us\":%lu,\"buckets\":[",
+             name, (unsigned long)st.count, (unsigned long)(st.count ? st.totalUs / st.count : 0),
+             (unsigned long)latencyPercentile(st, 50), (unsigned long)latencyPercentile(st, 99),
+             (unsigned long)st.maxUs);
+  for (uint8_t i = 0; i < LATENCY_BUCKETS; i++) {
+    out.printf(i == 0 ? "%lu" : ",%lu", (unsigned long)st.buckets[i]);
+  }
+  out.print("]}");
+}
+
+void resetStats() {
+  stats.command = LatencyStat();
+  stats.show = LatencyStat();
+  stats.render = LatencyStat();
+  stats.http = LatencyStat();
+  stats.net = LatencyStat();
+  memset(stats.commandCounts, 0, sizeof(stats.commandCounts));
+  stats.framesApplied = 0;
+  stats.framesStale = 0;
+  stats.framesRejected = 0;
+  stats.commandsStale = 0;
+  stats.ddpDropped = 0;
+}
+
+void cmdStats(char* args, Response& res);  // needs COMMANDS, defined after it
+void cmdBench(char* args, Response& res);  // needs runCommand, defined after it
+
+// SEQ reports the newest applied sequence number (0 if none) so a host can
+// continue from it; SEQ RESET forgets it.
+void cmdSeq(char* args, Response& res) {
+  char* sub = nextToken(args);
+  if (sub == nullptr) {
+    res.format("OK SEQ %lu", (unsigned long)(seqValid ? lastSeq : 0));
+    return;
+  }
+  if (strcasecmp(sub, "RESET") != 0 || !atEnd(args)) {
+    res.set("ERR usage: SEQ [RESET]");
+    return;
+  }
+  seqValid = false;
+  lastSeq = 0;
+  res.set("OK");
+}
+
+// TIME reports the shared clock; TIME <ms> sets it and TIME ADJ <+-ms> slews
+// it, both replying with the new value.
+void cmdTime(char* args, Response& res) {
+  char* tok = nextToken(args);
+  if (tok != nullptr) {
+    uint32_t ms;
+    int delta;
+    if (strcasecmp(tok, "ADJ") == 0 && nextInt(args, delta) && atEnd(args)) {
+      clockOffsetMs += (uint32_t)delta;
+    } else if (parseSeq(tok, ms) && atEnd(args)) {
+      clockOffsetMs = ms - millis();
+    } else {
+      res.set("ERR usage: TIME [<ms> | ADJ <+-ms>]");
+      return;
+    }
+  }
+  res.format("OK TIME %lu", (unsigned long)clockMs());
+}
+
+// Holds presentation until the TIME clock reaches `at`; false if that is
+// further ahead than MAX_HOLD_MS. A time already passed presents as usual.
+bool holdUntil(uint32_t at) {
+  const int32_t ahead = (int32_t)(at - clockMs());
+  if (ahead > MAX_HOLD_MS) return false;
+  holdActive = ahead > 0;
+  holdUntilMs = at;
+  xTaskNotifyGive(renderTaskHandle);  // to pick up the new deadline
+  return true;
+}
+
+// AT <ms> holds presentation of everything that follows until TIME reaches
+// ms; a later AT replaces the deadline. AT alone reports it.
+void cmdAt(char* args, Response& res) {
+  char* tok = nextToken(args);
+  if (tok == nullptr) {
+    if (holdActive) {
+      res.format("OK AT %lu", (unsigned long)holdUntilMs);
+    } else {
+      res.set("OK AT NONE");
+    }
+    return;
+  }
+  uint32_t at;
+  if (!parseSeq(tok, at) || !atEnd(args)) {
+    res.set("ERR usage: AT <ms>");
+    return;
+  }
+  if (!holdUntil(at)) {
+    res.format("ERR AT must be within %d ms", MAX_HOLD_MS);
+    return;
+  }
+  res.format("OK AT %lu", (unsigned long)at);
+}
+
+const CommandEntry COMMANDS[] = {
+  {"PING", cmdPing},
+  {"INFO", cmdInfo},
+  {"BRIGHT", cmdBright},
+  {"FILL", cmdFill},
+  {"SET", cmdSet},
+  {"SETN", cmdSetN},
+  {"SETMANY", cmdSetMany},
+  {"HOLD", cmdHold},
+  {"SHOW", cmdShow},
+  {"CLEAR", cmdClear},
+  {"FRAME", cmdFrame},
+  {"PALETTE", cmdPalette},
+  {"PFRAME", cmdPFrame},
+  {"FPS", cmdFps},
+  {"ROUTE", cmdRoute},
+  {"EFFECT", cmdEffect},
+  {"TIMELINE", cmdTimeline},
+  {"LAYOUT", cmdLayout},
+  {"GRID", cmdGrid},
+  {"REGION", cmdRegion},
+  {"RESTART", cmdRestart},
+  {"SEQ", cmdSeq},
+  {"TIME", cmdTime},
+  {"AT", cmdAt},
+  {"BAUD", cmdBaud},
+  {"STATS", cmdStats},
+  {"BENCH", cmdBench},
+  {"GAMMA", cmdGamma},
+  {"POWER", cmdPower},
+  {"WIFI", cmdWifi},
+};
+
+const size_t COMMAND_COUNT = sizeof(COMMANDS) / sizeof(COMMANDS[0]);
+static_assert(sizeof(COMMANDS) / sizeof(COMMANDS[0]) <= MAX_COMMAND_VERBS, "raise MAX_COMMAND_VERBS");
+
+// Latencies read count/avg/p99/max; p99 is the upper edge of its histogram
+// bucket. Per-verb counts follow "CMDS", skipping verbs never run.
+void cmdStats(char* args, Response& res) {
+  char* sub = nextToken(args);
+  if (sub != nullptr) {
+    if (strcasecmp(sub, "RESET") != 0 || !atEnd(args)) {
+      res.set("ERR usage: STATS [RESET]");
+      return;
+    }
+    resetStats();
+    res.set("OK");
+    return;
+  }
+
+  res.format("OK STATS up_s=%lu heap=%lu heap_min=%lu heap_max_block=%lu rssi=%d", millis() / 1000UL,
+             (unsigned long)ESP.getFreeHeap(), (unsigned long)ESP.getMinFreeHeap(),
+             (unsigned long)ESP.getMaxAllocHeap(), WiFi.status() == WL_CONNECTED ? (int)WiFi.RSSI() : 0);
+  res.append(" frames=%lu stale=%lu rejected=%lu cmd_stale=%lu ddp_dropped=%lu",
+             (unsigned long)stats.framesApplied.load(), (unsigned long)stats.framesStale.load(),
+             (unsigned long)stats.framesRejected.load(), (unsigned long)stats.commandsStale.load(),
+             (unsigned long)stats.ddpDropped.load());
+  appendLatency(res, "cmd", stats.command);
+  appendLatency(res, "show", stats.show);
+  appendLatency(res, "render", stats.render);
+  appendLatency(res, "http", stats.http);
+  appendLatency(res, "net", stats.net);
+  res.append(" CMDS");
+  for (size_t i = 0; i < COMMAND_COUNT; i++) {
+    if (stats.commandCounts[i] != 0) {
+      res.append(" %s=%lu", COMMANDS[i].verb, (unsigned long)stats.commandCounts[i]);
+    }
+  }
+}
+
+// Same data as STATS, for GET /stats. Call with stateLock held.
+void printStatsJson(Print& out) {
+  out.printf("{\"up_s\":%lu,\"heap\":%lu,\"heap_min\":%lu,\"heap_max_block\":%lu,", millis() / 1000UL,
+             (unsigned long)ESP.getFreeHeap(), (unsigned long)ESP.getMinFreeHeap(),
+             (unsigned long)ESP.getMaxAllocHeap());
+  if (WiFi.status() == WL_CONNECTED) {
+    out.printf("\"rssi\":%d,", (int)WiFi.RSSI());
+  } else {
+    out.print("\"rssi\":null,");
+  }
+  out.printf("\"frames\":%lu,\"stale\":%lu,\"rejected\":%lu,\"cmd_stale\":%lu,\"ddp_dropped\":%lu,",
+             (unsigned long)stats.framesApplied.load(), (unsigned long)stats.framesStale.load(),
+             (unsigned long)stats.framesRejected.load(), (unsigned long)stats.commandsStale.load(),
+             (unsigned long)stats.ddpDropped.load());
+  out.print("\"latency\":{");
+  printLatencyJson(out, "cmd", stats.command);
+  out.print(',');
+  printLatencyJson(out, "show", stats.show);
+  out.print(',');
+  printLatencyJson(out, "render", stats.render);
+  out.print(',');
+  printLatencyJson(out, "http", stats.http);
+  out.print(',');
+  printLatencyJson(out, "net", stats.net);
+  out.print("},\"commands\":{");
+  for (size_t i = 0; i < COMMAND_COUNT; i++) {
+    out.printf(i == 0 ? "\"%s\":%lu" : ",\"%s\":%lu", COMMANDS[i].verb, (unsigned long)stats.commandCounts[i]);
+  }
+  out.print("}}");
+}
+
+// Parses and executes one command line in place: `line` is tokenized
+// destructively and the verb upper-cased, so callers pass a scratch buffer.
+// A leading "@<seq>" token tags the command with a sequence number; a stale
+// command is skipped, and a successful one records its number.
+void runCommand(char* line, Response& res) {
+  while (isSpace(*line)) line++;
+  FrameQueue::Tag tag = {false, 0};
+  if (*line == '@') {
+    char* cursor = line + 1;
+    char* tok = nextToken(cursor);
+    if (tok == nullptr || !parseSeq(tok, tag.seq)) {
+      res.set("ERR invalid seq");
+      return;
+    }
+    tag.sequenced = true;
+    line = cursor;
+    if (seqIsStale(tag.seq)) {
+      stats.commandsStale++;
+      res.set("OK STALE");
+      return;
+    }
+  }
+  LatencyTimer timer(stats.command);
+  const CommandEntry* entry = dispatchCommand(COMMANDS, COMMAND_COUNT, line, res);
+  if (entry == nullptr) {
+    res.set("ERR unknown command");
+    return;
+  }
+  stats.commandCounts[entry - COMMANDS]++;
+  if (tag.sequenced && res.ok()) acceptSeq(tag.seq);
+}
+
+// Commands a batch can't take back, refused inside POST /batch: they write
+// NVS, restart the board, switch the link, wipe state the rollback doesn't
+// keep a copy of (STATS and TIMELINE CLEAR) or (BENCH) release stateLock
+// mid-command. Queries (GRID GET, bare GAMMA, ...) still run. `sub` nullptr:
+// every use; "": any use with arguments.
+struct BatchRule {
+  const char* verb;
+  const char* sub;
+};
+
+const BatchRule BATCH_REFUSED[] = {
+  {"BENCH", nullptr},
+  {"RESTART", nullptr},
+  {"BAUD", ""},
+  {"GAMMA", ""},
+  {"POWER", ""},
+  {"WIFI", "SLEEP"},
+  {"WIFI", "TXPOWER"},
+  {"WIFI", "LOCK"},
+  {"WIFI", "UNLOCK"},
+  {"WIFI", "IP"},
+  {"WIFI", "RECONNECT"},
+  {"WIFI", "RESET"},
+  {"GRID", "SET"},
+  {"GRID", "MAP"},
+  {"GRID", "RESET"},
+  {"REGION", "SET"},
+  {"REGION", "DELETE"},
+  {"LAYOUT", "SET"},
+  {"LAYOUT", "RESET"},
+  {"ROUTE", "SAVE"},
+  {"ROUTE", "DELETE"},
+  {"STATS", "RESET"},
+  {"TIMELINE", "CLEAR"},
+};
+
+bool batchAllows(const char* line) {
+  char head[48];  // room for a seq, a verb and a subcommand
+  strlcpy(head, line, sizeof(head));
+  char* cursor = head;
+  char* verb = nextToken(cursor);
+  if (verb != nullptr && *verb == '@') verb = nextToken(cursor);
+  if (verb == nullptr) return true;
+  const char* sub = nextToken(cursor);
+  for (const BatchRule& rule : BATCH_REFUSED) {
+    if (strcasecmp(verb, rule.verb) != 0) continue;
+    if (rule.sub == nullptr) return false;
+    if (sub != nullptr && (*rule.sub == '\0' || strcasecmp(sub, rule.sub) == 0)) return false;
+  }
+  return true;
+}
+
+// Everything the commands a batch allows can change, for rolling it back.
+struct BatchSnapshot {
+  uint8_t brightness;
+  EffectState effect;
+  bool seqValid;
+  uint32_t lastSeq;
+  bool holdActive;
+  uint32_t holdUntilMs;
+  uint32_t clockOffsetMs;
+  uint16_t maxFps;
+  uint8_t paletteSize;
+  CRGB palette[MAX_PALETTE_COLORS];
+  uint8_t keyframeCount;
+};
+
+BatchSnapshot batchUndo;
+CRGB batchLeds[MAX_LEDS];
+CRGB batchEffectBase[MAX_LEDS];
+
+size_t batchCommandCount(const char* body) {
+  size_t count = 0;
+  for (const char* line = body; line != nullptr;) {
+    const char* next = strchr(line, '\n');
+    while (line != next && isSpace(*line)) line++;
+    if (line != next && *line != '\0') count++;
+    line = next != nullptr ? next + 1 : nullptr;
+  }
+  return count;
+}
+
+// Runs a POST /batch body as one transaction: each line goes through
+// runCommand under a single hold of stateLock, so the render task presents
+// the result once, after the last command. The first ERR (or refused
+// command) puts back the frame, brightness, effect, seq, AT hold, clock, FPS,
+// palette and timeline, and skips the remaining lines. One result line per
+// command.
+bool runBatch(char* body, Print& out) {
+  Response res{httpResponse, sizeof(httpResponse)};
+  bool ok = true;
+  StateGuard guard;
+  BatchSnapshot& u = batchUndo;
+  memcpy(batchLeds, leds, frameBytes());
+  memcpy(batchEffectBase, effectBase, frameBytes());
+  u.brightness = FastLED.getBrightness();
+  u.effect = effect;
+  u.seqValid = seqValid;
+  u.lastSeq = lastSeq;
+  u.holdActive = holdActive;
+  u.holdUntilMs = holdUntilMs;
+  u.clockOffsetMs = clockOffsetMs;
+  u.maxFps = maxFps;
+  u.paletteSize = paletteSize;
+  memcpy(u.palette, palette, sizeof(u.palette));
+  u.keyframeCount = keyframeCount;
+
+  for (char* line = body; line != nullptr;) {
+    char* next = strchr(line, '\n');
+    if (next != nullptr) *next++ = '\0';
+    if (!atEnd(line)) {
+      if (!ok) {
+        res.set("ERR skipped");
+      } else if (!batchAllows(line)) {
+        res.set("ERR not allowed in batch");
+        ok = false;
+      } else {
+        runCommand(line, res);
+        ok = res.ok();
+      }
+      out.println(httpResponse);
+    }
+    line = next;
+  }
+  if (ok) return true;
+
+  memcpy(leds, batchLeds, frameBytes());
+  memcpy(effectBase, batchEffectBase, frameBytes());
+  FastLED.setBrightness(u.brightness);
+  effect = u.effect;
+  seqValid = u.seqValid;
+  lastSeq = u.lastSeq;
+  holdActive = u.holdActive;
+  holdUntilMs = u.holdUntilMs;
+  clockOffsetMs = u.clockOffsetMs;
+  maxFps = u.maxFps;
+  paletteSize = u.paletteSize;
+  memcpy(palette, u.palette, sizeof(palette));
+  keyframeCount = u.keyframeCount;  // KEY only appends, so this drops the batch's keyframes
+  xTaskNotifyGive(renderTaskHandle);  // to pick up the restored hold
+  return false;
+}
+
+void appendBench(Response& res, const char* name, uint32_t ops, unsigned long totalUs) {
+  const unsigned long tenthsPerOp = (unsigned long)((uint64_t)totalUs * 10 / ops);
+  const unsigned long perSec = totalUs ? (unsigned long)((uint64_t)ops * 1000000ULL / totalUs) : 0;
+  res.append(" %s_us=%lu.%lu %s_per_s=%lu", name, tenthsPerOp / 10, tenthsPerOp % 10, name, perSec);
+}
+
+// The test frame is the current back buffer, so the FRAME pass leaves the wall
+// as it was (apart from stopping any running effect). Called with stateLock
+// held, as all commands are; it's released while the render task runs the
+// show() pass.
+void cmdBench(char* args, Response& res) {
+  int iterations = BENCH_DEFAULT_ITERATIONS;
+  if (!atEnd(args) && (!nextInt(args, iterations) || !atEnd(args) || iterations < 1 ||
+                       iterations > BENCH_MAX_ITERATIONS)) {
+    res.format("ERR usage: BENCH [1-%d]", BENCH_MAX_ITERATIONS);
+    return;
+  }
+  if (benchRunning) {
+    res.set("ERR bench already running");
+    return;
+  }
+
+  const size_t hexChars = (size_t)ledCount * 6;
+  const size_t cmdBytes = 6 + hexChars + 1;  // "FRAME " + hex + NUL
+  const size_t binBytes = 1 + 2 + frameBytes() + 2;
+  char* cmd = (char*)malloc(cmdBytes + binBytes);
+  if (cmd == nullptr) {
+    res.set("ERR out of memory");
+    return;
+  }
+  benchRunning = true;
+
+  static const char HEX_DIGITS[] = "0123456789ABCDEF";
+  uint8_t* bin = reinterpret_cast<uint8_t*>(cmd + cmdBytes);
+  const uint8_t* rgb = reinterpret_cast<const uint8_t*>(leds);
+  memcpy(cmd, "FRAME ", 6);
+  bin[0] = BIN_FRAME_MAGIC;
+  bin[1] = (uint8_t)(ledCount & 0xFF);
+  bin[2] = (uint8_t)(ledCount >> 8);
+  uint16_t crc = crc16Update(crc16Update(0xFFFF, bin[1]), bin[2]);
+  for (size_t i = 0; i < frameBytes(); i++) {
+    cmd[6 + i * 2] = HEX_DIGITS[rgb[i] >> 4];
+    cmd[6 + i * 2 + 1] = HEX_DIGITS[rgb[i] & 0x0F];
+    bin[3 + i] = rgb[i];
+    crc = crc16Update(crc, rgb[i]);
+  }
+  cmd[6 + hexChars] = '\0';
+  bin[3 + frameBytes()] = (uint8_t)(crc & 0xFF);
+  bin[4 + frameBytes()] = (uint8_t)(crc >> 8);
+
+  const uint32_t n = (uint32_t)iterations;
+  unsigned long startUs = micros();
+  for (uint32_t i = 0; i < n; i++) {
+    decodeHexFrame(cmd + 6, hexChars, routeScratch);
+  }
+  const unsigned long hexUs = micros() - startUs;
+
+  BinFrameReader reader(nullptr);
+  reader.target = routeScratch;
+  startUs = micros();
+  for (uint32_t i = 0; i < n; i++) {
+    const char* response = nullptr;
+    beginBinFrame(reader, bin[0]);
+    for (size_t j = 1; j < binBytes; j++) feedBinFrame(reader, bin[j], response);
+  }
+  const unsigned long binUs = micros() - startUs;
+
+  // The synthetic FRAME commands would swamp STATS; put its counters back.
+  const LatencyStat commandStat = stats.command;
+  uint32_t commandCounts[MAX_COMMAND_VERBS];
+  memcpy(commandCounts, stats.commandCounts, sizeof(commandCounts));
+  char scratch[64];
+  startUs = micros();
+  for (uint32_t i = 0; i < n; i++) {
+    Response inner{scratch, sizeof(scratch)};
+    memcpy(cmd, "FRAME ", 6);  // runCommand tokenizes in place
+    runCommand(cmd, inner);
+  }
+  const unsigned long cmdUs = micros() - startUs;
+  stats.command = commandStat;
+  memcpy(stats.commandCounts, commandCounts, sizeof(commandCounts));
+
+  const uint16_t shows = (uint16_t)(n < BENCH_MAX_SHOWS ? n : BENCH_MAX_SHOWS);
+  benchBrightness = outputBrightness();
+  xSemaphoreGive(stateLock);
+  benchShows.store(shows);
+  xTaskNotifyGive(renderTaskHandle);
+  xSemaphoreTake(benchDone, portMAX_DELAY);
+  xSemaphoreTake(stateLock, portMAX_DELAY);
+
+  free(cmd);
+  benchRunning = false;
+  res.format("OK BENCH n=%lu leds=%u", (unsigned long)n, ledCount);
+  appendBench(res, "hex", n, hexUs);
+  appendBench(res, "bin", n, binUs);
+  appendBench(res, "cmd", n, cmdUs);
+  appendBench(res, "show", shows, benchShowUs);
+}
+
+// Accumulates serial bytes into lineBuf; returns true once a full line is
+// available. Overlong lines are discarded up to the next newline.
+bool readLine() {
+  expireBinFrame(binFrame, serialOut);
+
+  while (Serial.available()) {
+    char c = (char)Serial.read();
+    if (binFrame.state != BIN_IDLE) {
+      const char* response = nullptr;
+      if (feedBinFrame(binFrame, (uint8_t)c, response)) {
+        serialOut.println(response);
+      }
+      continue;
+    }
+    if (serialLine.len == 0 && !serialLine.overflow && isBinFrameMagic((uint8_t)c)) {
+      beginBinFrame(binFrame, (uint8_t)c);
+      continue;
+    }
+    const LineStatus status = lineFeed(serialLine, c);
+    if (status == LINE_READY) return true;
+    if (status == LINE_TOO_LONG) replyErr("line too long");
+  }
+  return false;
+}
+
+// `first` is the body's first byte; a binary body's magic is consumed here.
+void beginHexFrame(HexFrameReader& f, AsyncWebServerRequest* owner, uint8_t first) {
+  f = HexFrameReader();
+  f.owner = owner;
+  if (isBinFrameMagic(first)) {
+    f.binary = true;
+    httpBinFrame.target = httpFrames.acquire();
+    beginBinFrame(httpBinFrame, first);
+    return;
+  }
+  CRGB* slot = httpFrames.acquire();
+  hexStreamBegin(f, reinterpret_cast<uint8_t*>(slot), frameBytes());
+  if (slot == nullptr) {
+    stats.framesRejected++;
+    f.status = 503;
+    f.error = "ERR frame queue full";
+  }
+}
+
+void rejectHexFrame(HexFrameReader& f, const char* error = "ERR invalid frame payload") {
+  stats.framesRejected++;
+  f.status = 400;
+  f.error = error;
+}
+
+// Decodes one chunk of a frame body straight into the httpFrames slot. Both
+// kinds are committed only after the whole body checked out; whitespace after
+// a binary packet (a trailing newline) is ignored.
+void feedHexFrame(HexFrameReader& f, const uint8_t* data, size_t len) {
+  if (f.error != nullptr) return;
+  if (!f.binary) {
+    if (!hexStreamFeed(f, data, len)) rejectHexFrame(f);
+    return;
+  }
+  for (size_t i = 0; i < len; i++) {
+    if (httpBinFrame.state == BIN_IDLE) {
+      if (isSpace((char)data[i])) continue;
+      rejectHexFrame(f, "ERR data after binary frame");
+      return;
+    }
+    const char* response = nullptr;
+    if (!feedBinFrame(httpBinFrame, data[i], response)) continue;
+    if (strcmp(response, "OK") != 0) {
+      f.status = httpBinFrame.target == nullptr ? 503 : 400;  // feedBinFrame counted it
+      f.error = response;
+      return;
+    }
+    f.tag = {httpBinFrame.sequenced, httpBinFrame.seq};
+  }
+}
+
+// A POST /frame?at= whose body fails must not leave every transport held:
+// its deadline is moved to now, unless a later AT already replaced it.
+void releaseFrameHold(HexFrameReader& f) {
+  if (!f.holding) return;
+  f.holding = false;
+  StateGuard guard;
+  if (holdActive && holdUntilMs == f.atMs) {
+    holdUntilMs = clockMs();  // the render task ends the hold as if it ran out
+    xTaskNotifyGive(renderTaskHandle);
+  }
+}
+
+// Checks the completed body; true when it held exactly one full frame.
+bool finishHexFrame(HexFrameReader& f) {
+  if (f.error != nullptr) return false;
+  if (f.binary) {
+    if (httpBinFrame.state == BIN_IDLE) return true;
+    httpBinFrame.state = BIN_IDLE;
+    rejectHexFrame(f, "ERR binary frame truncated");
+    return false;
+  }
+  if (f.decoded == 0 && !f.hasPending) {
+    rejectHexFrame(f, "ERR missing body");
+    return false;
+  }
+  if (!hexStreamComplete(f)) {
+    rejectHexFrame(f);
+    return false;
+  }
+  return true;
+}
+
+// Services the persistent TCP frame stream. Only binary packets are accepted;
+// bytes outside a packet are skipped until the next magic byte.
+void serviceFrameStream() {
+  if (streamServer.hasClient()) {
+    if (streamClient) streamClient.stop();
+    streamClient = streamServer.available();
+    streamClient.setNoDelay(true);
+    streamFrame.state = BIN_IDLE;
+  }
+  if (!streamClient) return;
+  if (!streamClient.connected()) {
+    streamClient.stop();
+    return;
+  }
+
+  expireBinFrame(streamFrame, streamClient);
+
+  int avail;
+  while ((avail = streamClient.available()) > 0) {
+    int n = streamClient.read(streamChunk, avail < STREAM_CHUNK_BYTES ? avail : STREAM_CHUNK_BYTES);
+    if (n <= 0) break;
+    for (int i = 0; i < n; i++) {
+      const uint8_t b = streamChunk[i];
+      if (streamFrame.state == BIN_IDLE) {
+        if (isBinFrameMagic(b)) beginBinFrame(streamFrame, b);
+        continue;
+      }
+      const char* response = nullptr;
+      if (feedBinFrame(streamFrame, b, response)) {
+        streamClient.println(response);
+      }
+    }
+  }
+}
+
+// Applies one DDP datagram to ddpFrame and queues it on PUSH. Returns false if
+// the packet was malformed, addressed elsewhere or out of sequence.
+bool applyDdpPacket(const uint8_t* pkt, size_t len) {
+  if (len < DDP_HEADER_BYTES) return false;
+  const uint8_t flags = pkt[0];
+  if ((flags & DDP_FLAG_VERSION_MASK) != DDP_FLAG_VERSION_1) return false;
+  if (pkt[3] != DDP_ID_DEFAULT && pkt[3] != DDP_ID_ALL) return false;
+
+  // Sequence numbers are 4-bit (1..15, 0 = unused). Anything that isn't one
+  // to seven steps ahead of the last packet is a duplicate or arrived late.
+  const uint8_t seq = pkt[1] & 0x0F;
+  const unsigned long now = millis();
+  if (now - ddpLastPacketMs > DDP_SEQ_RESET_MS) ddpLastSeq = 0;
+  if (seq != 0 && ddpLastSeq != 0) {
+    const uint8_t ahead = (seq - ddpLastSeq) & 0x0F;
+    if (ahead == 0 || ahead > 7) return false;
+  }
+
+  const size_t header = DDP_HEADER_BYTES + ((flags & DDP_FLAG_TIMECODE) ? DDP_TIMECODE_BYTES : 0);
+  const uint32_t offset = ((uint32_t)pkt[4] << 24) | ((uint32_t)pkt[5] << 16) | ((uint32_t)pkt[6] << 8) | pkt[7];
+  const size_t dataLen = ((size_t)pkt[8] << 8) | pkt[9];
+  if (len < header + dataLen) return false;
+
+  ddpLastSeq = seq;
+  ddpLastPacketMs = now;
+
+  const size_t total = frameBytes();
+  if (offset < total) {
+    const size_t n = dataLen < total - offset ? dataLen : total - offset;
+    memcpy(reinterpret_cast<uint8_t*>(ddpFrame) + offset, pkt + header, n);
+  }
+  if (flags & DDP_FLAG_PUSH) {
+    CRGB* slot = netFrames.acquire();
+    if (slot == nullptr) return false;
+    memcpy(slot, ddpFrame, frameBytes());
+    commitFrame(netFrames);
+  }
+  return true;
+}
+
+void serviceDdp() {
+  for (int i = 0; i < DDP_MAX_PACKETS_PER_LOOP; i++) {
+    const int size = ddpUdp.parsePacket();
+    if (size <= 0) return;
+    const int n = ddpUdp.read(ddpPacket, sizeof(ddpPacket));
+    if (n > 0 && !applyDdpPacket(ddpPacket, (size_t)n)) {
+      stats.ddpDropped++;
+    }
+  }
+}
+
+void startNetworkServices() {
+  server.begin();
+  streamServer.begin();
+  streamServer.setNoDelay(true);
+  ddpUdp.begin(DDP_PORT);
+  httpServerStarted = true;
+}
+
+// Starts a connection attempt with the WIFI settings. A locked access point
+// is skipped on every other attempt, so a replaced one can't strand the wall.
+void beginWifiStation() {
+  const WifiConfig& c = wifiConfig;
+  const bool locked = c.channel != 0 && wifiAttempts % 2 == 0;
+  wifiAttempts++;
+  if (c.ip[0] != 0) {
+    WiFi.config(IPAddress(c.ip[0]), IPAddress(c.ip[1]), IPAddress(c.ip[2]), IPAddress(c.ip[3]));
+  } else {
+    WiFi.config(IPAddress((uint32_t)0), IPAddress((uint32_t)0), IPAddress((uint32_t)0));  // DHCP
+  }
+  WiFi.begin(WIFI_STA_SSID, WIFI_STA_PASS, locked ? c.channel : 0, locked ? c.bssid : nullptr);
+  applyWifiRadio();
+}
+
+// Network services start on the first GOT_IP; the listeners stay bound
+// across reconnects. Runs in the Wi-Fi event task, so nothing here blocks.
+void onWifiEvent(arduino_event_id_t event, arduino_event_info_t info) {
+  switch (event) {
+    case ARDUINO_EVENT_WIFI_STA_GOT_IP:
+      wifiAttempts = 0;
+      if (!httpServerStarted.load()) startNetworkServices();
+      logLine("Wi-Fi connected, IP: %s", WiFi.localIP().toString().c_str());
+      break;
+    case ARDUINO_EVENT_WIFI_STA_DISCONNECTED:
+      logLine("Wi-Fi disconnected, reason=%d", (int)info.wifi_sta_disconnected.reason);
+      break;
+    default:
+      break;
+  }
+}
+
+// Starts the first connect and returns; the net task retries from here on.
+void startWifiStation() {
+  if (std::strlen(WIFI_STA_SSID) == 0) {
+    Serial.println("WARN Wi-Fi credentials missing. Add include/wifi_secrets.h");
+    return;
+  }
+
+  WiFi.onEvent(onWifiEvent);
+  WiFi.mode(WIFI_STA);
+  WiFi.setAutoReconnect(true);
+  WiFi.persistent(false);
+  lastWifiRetryMs = millis();
+  beginWifiStation();
+
+  Serial.print("Connecting to Wi-Fi SSID: ");
+  Serial.println(WIFI_STA_SSID);
+}
+
+void maintainWifiConnection() {
+  if (std::strlen(WIFI_STA_SSID) == 0) {
+    return;
+  }
+  if (wifiReconnectPending.exchange(false)) {
+    logLine("Wi-Fi reconnecting with new settings...");
+    WiFi.disconnect();
+    wifiAttempts = 0;
+    lastWifiRetryMs = millis();
+    beginWifiStation();
+    return;
+  }
+  if (WiFi.status() == WL_CONNECTED) {
+    return;
+  }
+
+  const unsigned long now = millis();
+  if (now - lastWifiRetryMs < WIFI_RETRY_INTERVAL_MS) {
+    return;
+  }
+  lastWifiRetryMs = now;
+
+  logLine("Wi-Fi disconnected, retrying...");
+  WiFi.disconnect();
+  beginWifiStation();
+}
+
+void applyPendingBaud() {
+  const uint32_t baud = pendingBaud.exchange(0);
+  if (baud == 0) return;
+  Serial.flush();
+#if !SERIAL_USB_CDC
+  Serial.updateBaudRate(baud);
+#endif
+  serialBaud = baud;
+}
+
+void serialTask(void*) {
+  for (;;) {
+    if (!readLine()) {
+      writeQueuedLogs();
+      serialOut.flush();
+      applyPendingBaud();
+      vTaskDelay(1);
+      continue;
+    }
+    char* line = lineBuf;
+    const char* id = nullptr;
+    if (*line == '#') {
+      id = nextToken(line);
+      if (strlen(id) > MAX_COMMAND_ID_CHARS + 1) {
+        replyErr("command id too long");
+        serialLine.len = 0;
+        continue;
+      }
+    }
+    Response res{serialResponse, sizeof(serialResponse)};
+    waitForDrain(serialFrames);
+    {
+      StateGuard guard;
+      runCommand(line, res);
+    }
+    if (id != nullptr) {
+      serialOut.print(id);
+      serialOut.print(' ');
+    }
+    serialOut.println(serialResponse);
+    serialLine.len = 0;
+  }
+}
+
+void netTask(void*) {
+  for (;;) {
+    if (restartAtMs != 0 && (long)(millis() - restartAtMs) >= 0) {
+      saveLastState(true);
+      ESP.restart();
+    }
+    saveLastState(false);
+    pushShownState();
+    {
+      LatencyTimer timer(stats.net);
+      maintainWifiConnection();
+      if (httpServerStarted.load()) {
+        serviceFrameStream();
+        serviceDdp();
+      }
+    }
+    vTaskDelay(1);
+  }
+}
+
+void setup() {
+  Serial.setRxBufferSize(SERIAL_RX_BUFFER_BYTES);
+  Serial.begin(SERIAL_BAUD);
+
+  loadLayout();
+  loadHolds();
+  loadOutputConfig();
+  loadWifiConfig();
+  addStripControllers();
+  FastLED.setBrightness(DEFAULT_BRIGHTNESS);
+  if (loadLastState()) {
+    copyToFront();  // the render task isn't running yet
+    shownBrightness = outputBrightness();
+    FastLED.show(shownBrightness);
+  } else {
+    FastLED.clear(true);
+  }
+
+  stateLock = xSemaphoreCreateMutex();
+  benchDone = xSemaphoreCreateBinary();
+  logQueue = xQueueCreate(LOG_QUEUE_LINES, LOG_LINE_CHARS);
+  loadRouteTable();
+  xTaskCreatePinnedToCore(renderTask, "render", RENDER_TASK_STACK, nullptr, RENDER_TASK_PRIORITY,
+                          &renderTaskHandle, RENDER_TASK_CORE);
+
+  server.on("/", HTTP_GET, [](AsyncWebServerRequest* request) {
+    String msg = "LED Wall ESP32 STA ready\n";
+    msg += "SSID: ";
+    msg += WIFI_STA_SSID;
+    msg += "\nIP: ";
+    msg += (WiFi.status() == WL_CONNECTED) ? WiFi.localIP().toString() : "DISCONNECTED";
+    msg += "\nUse /cmd?q=PING\n";
+    request->send(200, "text/plain", msg);
+  });
+
+  // Handlers run one at a time on the AsyncTCP task, so httpCommand and
+  // httpResponse need no extra locking.
+  server.on("/cmd", HTTP_GET, [](AsyncWebServerRequest* request) {
+    LatencyTimer timer(stats.http);
+    const AsyncWebParameter* q = request->getParam("q");
+    if (q == nullptr || q->value().length() == 0) {
+      request->send(400, "text/plain", "ERR missing q");
+      return;
+    }
+    if (q->value().length() > MAX_COMMAND_CHARS) {
+      request->send(400, "text/plain", "ERR line too long");
+      return;
+    }
+    memcpy(httpCommand, q->value().c_str(), q->value().length() + 1);
+    Response res{httpResponse, sizeof(httpResponse)};
+    waitForDrain(httpFrames);
+    {
+      StateGuard guard;
+      runCommand(httpCommand, res);
+    }
+    request->send(res.ok() ? 200 : 400, "text/plain", httpResponse);
+  });
+
+  // The body arrives in TCP-segment-sized chunks and is decoded in place, so
+  // no request-sized String is ever allocated. A second client posting while
+  // a body is still in flight gets 503 rather than sharing the slot.
+  server.on(
+      "/frame", HTTP_POST,
+      [](AsyncWebServerRequest* request) {
+        LatencyTimer timer(stats.http);
+        if (httpFrame.owner != request) {
+          stats.framesRejected++;
+          if (request->contentLength() == 0) {
+            request->send(400, "text/plain", "ERR missing body");
+          } else {
+            request->send(503, "text/plain", "ERR frame busy");
+          }
+          return;
+        }
+        if (!finishHexFrame(httpFrame)) {
+          releaseFrameHold(httpFrame);
+          request->send(httpFrame.status, "text/plain", httpFrame.error);
+        } else {
+          if (commitFrame(httpFrames, httpFrame.tag)) {
+            request->send(200, "text/plain", "OK");
+          } else {
+            releaseFrameHold(httpFrame);
+            request->send(200, "text/plain", "OK STALE");
+          }
+        }
+        httpFrame = HexFrameReader();
+      },
+      nullptr,
+      [](AsyncWebServerRequest* request, uint8_t* data, size_t len, size_t index, size_t total) {
+        LatencyTimer timer(stats.http);
+        if (index == 0 && httpFrame.owner == nullptr && len > 0) {
+          beginHexFrame(httpFrame, request, data[0]);
+          if (httpFrame.binary) {
+            data++;
+            len--;
+          }
+          const AsyncWebParameter* seq = request->getParam("seq");
+          if (seq != nullptr && !httpFrame.binary) {  // packets carry their own
+            httpFrame.tag.sequenced = true;
+            if (!parseSeq(seq->value().c_str(), httpFrame.tag.seq) && httpFrame.error == nullptr) {
+              rejectHexFrame(httpFrame, "ERR invalid seq");
+            }
+          }
+          const AsyncWebParameter* at = request->getParam("at");
+          if (at != nullptr && httpFrame.error == nullptr) {
+            StateGuard guard;
+            uint32_t ms;
+            if (!parseSeq(at->value().c_str(), ms) || !holdUntil(ms)) {
+              rejectHexFrame(httpFrame, "ERR invalid at");
+            } else {
+              httpFrame.holding = true;
+              httpFrame.atMs = ms;
+            }
+          }
+          request->onDisconnect([request]() {
+            if (httpFrame.owner != request) return;
+            releaseFrameHold(httpFrame);
+            if (httpFrame.binary) httpBinFrame.state = BIN_IDLE;
+            httpFrame = HexFrameReader();
+          });
+        }
+        if (httpFrame.owner == request) {
+          feedHexFrame(httpFrame, data, len);
+        }
+      });
+
+  server.on(
+      "/batch", HTTP_POST,
+      [](AsyncWebServerRequest* request) {
+        LatencyTimer timer(stats.http);
+        if (httpBatch.owner != request) {
+          if (request->contentLength() == 0) {
+            request->send(400, "text/plain", "ERR missing body");
+          } else {
+            request->send(503, "text/plain", "ERR batch busy");
+          }
+          return;
+        }
+        if (httpBatch.overflow) {
+          httpBatch = BatchReader();
+          request->send(413, "text/plain", "ERR batch too long");
+          return;
+        }
+        batchBody[httpBatch.len] = '\0';
+        if (batchCommandCount(batchBody) > MAX_BATCH_COMMANDS) {
+          httpBatch = BatchReader();
+          request->send(413, "text/plain", "ERR batch has too many commands");
+          return;
+        }
+        AsyncResponseStream* response = request->beginResponseStream("text/plain");
+        waitForDrain(httpFrames);
+        if (!runBatch(batchBody, *response)) response->setCode(400);
+        httpBatch = BatchReader();
+        request->send(response);
+      },
+      nullptr,
+      [](AsyncWebServerRequest* request, uint8_t* data, size_t len, size_t index, size_t total) {
+        LatencyTimer timer(stats.http);
+        if (index == 0 && httpBatch.owner == nullptr) {
+          httpBatch.owner = request;
+          httpBatch.overflow = total > MAX_BATCH_CHARS;
+          request->onDisconnect([request]() {
+            if (httpBatch.owner == request) httpBatch = BatchReader();
+          });
+        }
+        if (httpBatch.owner != request || httpBatch.overflow) return;
+        if (httpBatch.len + len > MAX_BATCH_CHARS) {
+          httpBatch.overflow = true;
+          return;
+        }
+        memcpy(batchBody + httpBatch.len, data, len);
+        httpBatch.len += len;
+      });
+
+  server.on("/stats", HTTP_GET, [](AsyncWebServerRequest* request) {
+    AsyncResponseStream* response = request->beginResponseStream("application/json");
+    {
+      StateGuard guard;
+      printStatsJson(*response);
+    }
+    request->send(response);
+  });
+
+  events.onConnect([](AsyncEventSourceClient*) { eventsResync.store(true); });
+  server.addHandler(&events);
+
+  // Handlers are registered before the first connect, so GOT_IP can start
+  // the server as soon as it fires.
+  startWifiStation();
+
+  Serial.println("READY");
+  xTaskCreate(serialTask, "serial", SERIAL_TASK_STACK, nullptr, SERIAL_TASK_PRIORITY, nullptr);
+  xTaskCreatePinnedToCore(netTask, "net", NET_TASK_STACK, nullptr, NET_TASK_PRIORITY, nullptr, NET_TASK_CORE);
+}
+
+void loop() {
+  // All work happens in the serial, net and render tasks started by setup().
+  vTaskDelete(nullptr);
 }
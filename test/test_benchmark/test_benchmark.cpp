@@ -0,0 +1,163 @@
+// Host-side throughput of the LedProtocol hot paths, for comparing changes
+// before flashing: pio test -e native -f test_benchmark -v
+//
+// Numbers are for the build machine, not the ESP32; use the firmware's BENCH
+// command (or python-stuff/bench.py) for on-device figures.
+
+#include <LedProtocol.h>
+#include <unity.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#define BENCH_LEDS 600  // MAX_LEDS in the firmware
+#define BENCH_ITERATIONS 2000
+
+static const char* HEX_DIGITS = "0123456789ABCDEF";
+
+static std::vector<uint8_t> rgb;
+static std::vector<char> hex;
+static std::vector<uint8_t> packet;
+static std::vector<uint8_t> lzPacket;  // rgb's first 10 pixels, repeated
+static std::vector<uint8_t> out;
+static volatile uint32_t sink;  // keeps results observable to the optimizer
+
+// Runs `op` BENCH_ITERATIONS times and reports the mean cost and throughput.
+template <typename Op>
+static void bench(const char* name, size_t bytes, Op op) {
+  op();  // warm up
+  const auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < BENCH_ITERATIONS; i++) op();
+  const double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+  const double perOpUs = us / BENCH_ITERATIONS;
+  char msg[128];
+  snprintf(msg, sizeof(msg), "%s: %.2f us/op, %.0f ops/s, %.1f MB/s", name, perOpUs, 1e6 / perOpUs,
+           bytes / perOpUs);
+  TEST_MESSAGE(msg);
+}
+
+void setUp() {}
+void tearDown() {}
+
+void test_bench_decode_hex() {
+  bench("decodeHex 600 LEDs", hex.size(), [] {
+    TEST_ASSERT_TRUE(decodeHex(hex.data(), hex.size(), out.data()));
+    sink = out[0];
+  });
+}
+
+// Byte-at-a-time table decode, the baseline decodeHex8 is measured against.
+void test_bench_decode_hex_table() {
+  bench("parseHexByte 600 LEDs", hex.size(), [] {
+    for (size_t i = 0; i < out.size(); i++) parseHexByte(hex.data() + i * 2, out[i]);
+    sink = out[0];
+  });
+}
+
+void test_bench_hex_stream() {
+  bench("hexStreamFeed 600 LEDs, 536 B chunks", hex.size(), [] {
+    HexStreamDecoder d;
+    hexStreamBegin(d, out.data(), out.size());
+    const uint8_t* body = reinterpret_cast<const uint8_t*>(hex.data());
+    for (size_t i = 0; i < hex.size(); i += 536) {
+      hexStreamFeed(d, body + i, hex.size() - i < 536 ? hex.size() - i : 536);
+    }
+    TEST_ASSERT_TRUE(hexStreamComplete(d));
+  });
+}
+
+void test_bench_bin_frame() {
+  bench("binFrameFeed 600 LEDs", packet.size(), [] {
+    BinFrameParser p;
+    binFrameBegin(p, packet[0]);
+    for (size_t i = 1; i < packet.size(); i++) binFrameFeed(p, packet[i], out.data(), BENCH_LEDS);
+    TEST_ASSERT_EQUAL_HEX16(p.expectedCrc, p.crc);
+  });
+}
+
+void test_bench_bin_frame_lz() {
+  bench("binFrameFeed 600 LEDs, compressed", lzPacket.size(), [] {
+    BinFrameParser p;
+    binFrameBegin(p, lzPacket[0]);
+    for (size_t i = 1; i < lzPacket.size(); i++) binFrameFeed(p, lzPacket[i], out.data(), BENCH_LEDS);
+    TEST_ASSERT_TRUE(binFrameDecoded(p));
+  });
+}
+
+static void cmdNop(char* args, Response& res) {
+  res.set("OK");
+}
+
+static const CommandEntry BENCH_COMMANDS[] = {
+    {"PING", cmdNop}, {"INFO", cmdNop}, {"CLEAR", cmdNop}, {"SET", cmdNop},
+    {"FILL", cmdNop}, {"FRAME", cmdNop}, {"SHOW", cmdNop}, {"SETMANY", cmdNop},
+};
+
+void test_bench_dispatch() {
+  char line[64];
+  char buf[32];
+  bench("dispatchCommand SETMANY", sizeof("setmany 0-9 255 0 0") - 1, [&] {
+    memcpy(line, "setmany 0-9 255 0 0", sizeof("setmany 0-9 255 0 0"));
+    Response res{buf, sizeof(buf)};
+    TEST_ASSERT_TRUE(dispatchCommand(BENCH_COMMANDS, 8, line, res) != nullptr);
+  });
+}
+
+void test_bench_line_assembler() {
+  std::vector<char> buf(hex.size() + 8);
+  bench("lineFeed FRAME line", hex.size(), [&] {
+    LineAssembler line(buf.data(), buf.size() - 1);
+    for (char c : hex) lineFeed(line, c);
+    TEST_ASSERT_EQUAL(LINE_READY, lineFeed(line, '\n'));
+  });
+}
+
+int main(int argc, char** argv) {
+  rgb.resize(BENCH_LEDS * 3);
+  for (size_t i = 0; i < rgb.size(); i++) rgb[i] = (uint8_t)(i * 37 + 11);
+  for (uint8_t b : rgb) {
+    hex.push_back(HEX_DIGITS[b >> 4]);
+    hex.push_back(HEX_DIGITS[b & 0x0F]);
+  }
+  out.resize(rgb.size());
+
+  uint16_t crc = 0xFFFF;
+  packet.push_back(BIN_FRAME_MAGIC);
+  packet.push_back((uint8_t)(BENCH_LEDS & 0xFF));
+  packet.push_back((uint8_t)(BENCH_LEDS >> 8));
+  for (size_t i = 1; i < packet.size(); i++) crc = crc16Update(crc, packet[i]);
+  for (uint8_t b : rgb) {
+    packet.push_back(b);
+    crc = crc16Update(crc, b);
+  }
+  packet.push_back((uint8_t)(crc & 0xFF));
+  packet.push_back((uint8_t)(crc >> 8));
+
+  std::vector<uint8_t> ops(rgb.begin(), rgb.begin() + 30);
+  ops.insert(ops.begin(), 29);
+  for (size_t done = 30; done < rgb.size(); done += 66) {
+    const size_t len = rgb.size() - done < 66 ? rgb.size() - done : 66;
+    ops.push_back((uint8_t)(0xC0 | (len - 3)));
+    ops.push_back(30);
+    ops.push_back(0);
+  }
+  lzPacket = {BIN_FRAME_LZ_MAGIC, (uint8_t)(BENCH_LEDS & 0xFF), (uint8_t)(BENCH_LEDS >> 8),
+              (uint8_t)(ops.size() & 0xFF), (uint8_t)(ops.size() >> 8)};
+  lzPacket.insert(lzPacket.end(), ops.begin(), ops.end());
+  crc = 0xFFFF;
+  for (size_t i = 1; i < lzPacket.size(); i++) crc = crc16Update(crc, lzPacket[i]);
+  lzPacket.push_back((uint8_t)(crc & 0xFF));
+  lzPacket.push_back((uint8_t)(crc >> 8));
+
+  UNITY_BEGIN();
+  RUN_TEST(test_bench_decode_hex);
+  RUN_TEST(test_bench_decode_hex_table);
+  RUN_TEST(test_bench_hex_stream);
+  RUN_TEST(test_bench_bin_frame);
+  RUN_TEST(test_bench_bin_frame_lz);
+  RUN_TEST(test_bench_dispatch);
+  RUN_TEST(test_bench_line_assembler);
+  return UNITY_END();
+}
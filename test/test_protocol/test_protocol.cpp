@@ -0,0 +1,589 @@
+// Unit tests for lib/LedProtocol: pio test -e native -f test_protocol
+
+#include <LedProtocol.h>
+#include <unity.h>
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+static const char* HEX_DIGITS = "0123456789ABCDEF";
+
+static std::vector<uint8_t> pattern(size_t bytes) {
+  std::vector<uint8_t> out(bytes);
+  for (size_t i = 0; i < bytes; i++) out[i] = (uint8_t)(i * 37 + 11);
+  return out;
+}
+
+static std::string toHex(const std::vector<uint8_t>& bytes) {
+  std::string out;
+  for (uint8_t b : bytes) {
+    out += HEX_DIGITS[b >> 4];
+    out += HEX_DIGITS[b & 0x0F];
+  }
+  return out;
+}
+
+static std::vector<uint8_t> binPacket(const std::vector<uint8_t>& rgb, bool sequenced, uint32_t seq) {
+  std::vector<uint8_t> body;
+  if (sequenced) {
+    for (int i = 0; i < 4; i++) body.push_back((uint8_t)(seq >> (8 * i)));
+  }
+  const uint16_t count = (uint16_t)(rgb.size() / 3);
+  body.push_back((uint8_t)(count & 0xFF));
+  body.push_back((uint8_t)(count >> 8));
+  body.insert(body.end(), rgb.begin(), rgb.end());
+  uint16_t crc = 0xFFFF;
+  for (uint8_t b : body) crc = crc16Update(crc, b);
+
+  std::vector<uint8_t> pkt;
+  pkt.push_back(sequenced ? BIN_FRAME_SEQ_MAGIC : BIN_FRAME_MAGIC);
+  pkt.insert(pkt.end(), body.begin(), body.end());
+  pkt.push_back((uint8_t)(crc & 0xFF));
+  pkt.push_back((uint8_t)(crc >> 8));
+  return pkt;
+}
+
+static std::vector<uint8_t> lzPacket(const std::vector<uint8_t>& ops, uint16_t count, bool sequenced, uint32_t seq) {
+  std::vector<uint8_t> body;
+  if (sequenced) {
+    for (int i = 0; i < 4; i++) body.push_back((uint8_t)(seq >> (8 * i)));
+  }
+  body.push_back((uint8_t)(count & 0xFF));
+  body.push_back((uint8_t)(count >> 8));
+  body.push_back((uint8_t)(ops.size() & 0xFF));
+  body.push_back((uint8_t)(ops.size() >> 8));
+  body.insert(body.end(), ops.begin(), ops.end());
+  uint16_t crc = 0xFFFF;
+  for (uint8_t b : body) crc = crc16Update(crc, b);
+
+  std::vector<uint8_t> pkt;
+  pkt.push_back(sequenced ? BIN_FRAME_LZ_SEQ_MAGIC : BIN_FRAME_LZ_MAGIC);
+  pkt.insert(pkt.end(), body.begin(), body.end());
+  pkt.push_back((uint8_t)(crc & 0xFF));
+  pkt.push_back((uint8_t)(crc >> 8));
+  return pkt;
+}
+
+// Feeds a packet after its magic; returns the number of bytes consumed.
+static size_t feedPacket(BinFrameParser& p, const std::vector<uint8_t>& pkt, uint8_t* target, uint16_t leds) {
+  binFrameBegin(p, pkt[0]);
+  for (size_t i = 1; i < pkt.size(); i++) {
+    if (binFrameFeed(p, pkt[i], target, leds)) return i + 1;
+  }
+  return pkt.size();
+}
+
+void setUp() {}
+void tearDown() {}
+
+void test_parse_hex_byte() {
+  uint8_t b = 0;
+  TEST_ASSERT_TRUE(parseHexByte("00", b));
+  TEST_ASSERT_EQUAL_UINT8(0x00, b);
+  TEST_ASSERT_TRUE(parseHexByte("fF", b));
+  TEST_ASSERT_EQUAL_UINT8(0xFF, b);
+  TEST_ASSERT_TRUE(parseHexByte("a5", b));
+  TEST_ASSERT_EQUAL_UINT8(0xA5, b);
+  TEST_ASSERT_FALSE(parseHexByte("g0", b));
+  TEST_ASSERT_FALSE(parseHexByte("0 ", b));
+  TEST_ASSERT_FALSE(parseHexByte("\xC0" "0", b));
+}
+
+// The SWAR path must agree with the table for every byte in every lane.
+void test_decode_hex8_matches_table() {
+  char hex[9] = {};
+  for (int lane = 0; lane < 8; lane++) {
+    for (int c = 0; c < 256; c++) {
+      memcpy(hex, "a0B1c2D3", 8);
+      hex[lane] = (char)c;
+      uint8_t swar[4] = {};
+      uint8_t table[4] = {};
+      bool tableOk = true;
+      for (int i = 0; i < 4; i++) tableOk &= parseHexByte(hex + i * 2, table[i]);
+      const bool swarOk = decodeHex8(hex, swar);
+      TEST_ASSERT_EQUAL(tableOk, swarOk);
+      if (tableOk) TEST_ASSERT_EQUAL_UINT8_ARRAY(table, swar, 4);
+    }
+  }
+}
+
+void test_decode_hex() {
+  const std::vector<uint8_t> bytes = pattern(3 * 35);
+  const std::string hex = toHex(bytes);
+  std::vector<uint8_t> out(bytes.size());
+  TEST_ASSERT_TRUE(decodeHex(hex.data(), hex.size(), out.data()));
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(bytes.data(), out.data(), bytes.size());
+
+  TEST_ASSERT_FALSE(decodeHex(hex.data(), hex.size() - 1, out.data()));
+  std::string bad = hex;
+  bad[hex.size() - 3] = 'x';  // in the table-decoded tail
+  TEST_ASSERT_FALSE(decodeHex(bad.data(), bad.size(), out.data()));
+  bad = hex;
+  bad[5] = 'x';  // in a SWAR block
+  TEST_ASSERT_FALSE(decodeHex(bad.data(), bad.size(), out.data()));
+}
+
+void test_indexed_frame() {
+  const uint8_t pal[4 * 3] = {0, 0, 0, 255, 0, 0, 0, 255, 0, 0, 0, 255};
+  uint8_t out[5 * 3];
+  // 2 bits per LED: indices 1 2 3 0 | 2 (then padding) -> 0x6C 0x80.
+  TEST_ASSERT_EQUAL(4, indexedFrameHexChars(5, 2));
+  TEST_ASSERT_TRUE(decodeIndexedFrame("6C80", 4, 2, pal, 4, 5, out));
+  const uint8_t expected[5 * 3] = {255, 0, 0, 0, 255, 0, 0, 0, 255, 0, 0, 0, 0, 255, 0};
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(expected, out, sizeof(expected));
+
+  // 1 bit per LED: 10100 -> 0xA0.
+  TEST_ASSERT_TRUE(decodeIndexedFrame("a0", 2, 1, pal, 2, 5, out));
+  TEST_ASSERT_EQUAL_UINT8(255, out[0]);
+  TEST_ASSERT_EQUAL_UINT8(0, out[3]);
+  TEST_ASSERT_EQUAL_UINT8(255, out[6]);
+
+  // 4 bits per LED, index 15 needs a 16-color palette.
+  uint8_t big[16 * 3];
+  for (int i = 0; i < 16 * 3; i++) big[i] = (uint8_t)i;
+  TEST_ASSERT_FALSE(decodeIndexedFrame("F0123", 5, 4, big, 16, 5, out));  // odd length
+  TEST_ASSERT_TRUE(decodeIndexedFrame("F01230", 6, 4, big, 16, 5, out));
+  TEST_ASSERT_EQUAL_UINT8(45, out[0]);
+  TEST_ASSERT_EQUAL_UINT8(3 * 3, out[12]);
+  TEST_ASSERT_FALSE(decodeIndexedFrame("F01230", 6, 4, big, 15, 5, out));
+
+  TEST_ASSERT_FALSE(decodeIndexedFrame("6C80", 4, 2, pal, 3, 5, out));    // index 3 past the palette
+  TEST_ASSERT_FALSE(decodeIndexedFrame("6C8000", 6, 2, pal, 4, 5, out));  // too long
+  TEST_ASSERT_FALSE(decodeIndexedFrame("6C8", 3, 2, pal, 4, 5, out));
+  TEST_ASSERT_FALSE(decodeIndexedFrame("6C80", 4, 3, pal, 4, 5, out));    // unsupported width
+  TEST_ASSERT_FALSE(decodeIndexedFrame("6CX0", 4, 2, pal, 4, 5, out));
+}
+
+// CRC-16/CCITT-FALSE check value.
+void test_crc16() {
+  uint16_t crc = 0xFFFF;
+  for (const char* p = "123456789"; *p != '\0'; p++) crc = crc16Update(crc, (uint8_t)*p);
+  TEST_ASSERT_EQUAL_HEX16(0x29B1, crc);
+}
+
+void test_bin_frame_plain() {
+  const std::vector<uint8_t> rgb = pattern(3 * 35);
+  const std::vector<uint8_t> pkt = binPacket(rgb, false, 0);
+  std::vector<uint8_t> out(rgb.size());
+  BinFrameParser p;
+  TEST_ASSERT_TRUE(isBinFrameMagic(pkt[0]));
+  TEST_ASSERT_EQUAL(pkt.size(), feedPacket(p, pkt, out.data(), 35));
+  TEST_ASSERT_EQUAL(BIN_IDLE, p.state);
+  TEST_ASSERT_FALSE(p.sequenced);
+  TEST_ASSERT_EQUAL_UINT16(35, p.count);
+  TEST_ASSERT_EQUAL_HEX16(p.expectedCrc, p.crc);
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(rgb.data(), out.data(), rgb.size());
+}
+
+void test_bin_frame_sequenced() {
+  const std::vector<uint8_t> rgb = pattern(3 * 4);
+  const std::vector<uint8_t> pkt = binPacket(rgb, true, 0xDEADBEEF);
+  std::vector<uint8_t> out(rgb.size());
+  BinFrameParser p;
+  TEST_ASSERT_EQUAL(pkt.size(), feedPacket(p, pkt, out.data(), 4));
+  TEST_ASSERT_TRUE(p.sequenced);
+  TEST_ASSERT_EQUAL_HEX32(0xDEADBEEF, p.seq);
+  TEST_ASSERT_EQUAL_HEX16(p.expectedCrc, p.crc);
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(rgb.data(), out.data(), rgb.size());
+}
+
+void test_bin_frame_bad_crc() {
+  std::vector<uint8_t> pkt = binPacket(pattern(3 * 4), true, 7);
+  pkt[2] ^= 0x01;  // inside the seq, which the CRC covers
+  BinFrameParser p;
+  feedPacket(p, pkt, nullptr, 4);
+  TEST_ASSERT_NOT_EQUAL(p.expectedCrc, p.crc);
+}
+
+// A packet of the wrong size is consumed whole but never written.
+void test_bin_frame_count_mismatch() {
+  const std::vector<uint8_t> pkt = binPacket(pattern(3 * 5), false, 0);
+  std::vector<uint8_t> out(3 * 4, 0);
+  BinFrameParser p;
+  TEST_ASSERT_EQUAL(pkt.size(), feedPacket(p, pkt, out.data(), 4));
+  TEST_ASSERT_EQUAL_UINT16(5, p.count);
+  for (uint8_t b : out) TEST_ASSERT_EQUAL_UINT8(0, b);
+}
+
+void test_bin_frame_empty() {
+  const std::vector<uint8_t> pkt = binPacket({}, false, 0);
+  BinFrameParser p;
+  TEST_ASSERT_EQUAL(pkt.size(), feedPacket(p, pkt, nullptr, 35));
+  TEST_ASSERT_EQUAL_UINT16(0, p.count);
+  TEST_ASSERT_EQUAL_HEX16(p.expectedCrc, p.crc);
+}
+
+// Two red pixels (literal + overlapping copy), four dark ones, then the first
+// three pixels again.
+static const std::vector<uint8_t> LZ_OPS = {0x02, 0xFF, 0x00, 0x00, 0xC0, 0x03, 0x00,
+                                            0x80, 0x0B, 0xC6, 0x12, 0x00};
+
+static std::vector<uint8_t> lzExpected() {
+  std::vector<uint8_t> rgb(3 * 9, 0);
+  for (int i : {0, 3, 18, 21}) rgb[i] = 0xFF;
+  return rgb;
+}
+
+void test_inflate() {
+  const std::vector<uint8_t> expected = lzExpected();
+  std::vector<uint8_t> out(expected.size(), 0xEE);
+  FrameInflater z;
+  inflateBegin(z, out.data(), out.size());
+  for (uint8_t b : LZ_OPS) TEST_ASSERT_TRUE(inflateFeed(z, b));
+  TEST_ASSERT_TRUE(inflateComplete(z));
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(expected.data(), out.data(), expected.size());
+}
+
+void test_inflate_rejects() {
+  uint8_t out[6];
+  FrameInflater z;
+
+  inflateBegin(z, out, sizeof(out));  // copy from before the start
+  TEST_ASSERT_TRUE(inflateFeed(z, 0x00));
+  TEST_ASSERT_TRUE(inflateFeed(z, 0x11));
+  TEST_ASSERT_TRUE(inflateFeed(z, 0xC0));
+  TEST_ASSERT_TRUE(inflateFeed(z, 0x02));
+  TEST_ASSERT_FALSE(inflateFeed(z, 0x00));
+  TEST_ASSERT_FALSE(inflateFeed(z, 0x00));  // spent
+  TEST_ASSERT_FALSE(inflateComplete(z));
+
+  inflateBegin(z, out, sizeof(out));  // zero run past the end
+  TEST_ASSERT_TRUE(inflateFeed(z, 0x80));
+  TEST_ASSERT_FALSE(inflateFeed(z, 0x06));
+
+  inflateBegin(z, out, sizeof(out));  // literals past the end
+  TEST_ASSERT_TRUE(inflateFeed(z, 0x06));
+  for (int i = 0; i < 6; i++) TEST_ASSERT_TRUE(inflateFeed(z, 0x22));
+  TEST_ASSERT_FALSE(inflateFeed(z, 0x22));
+
+  inflateBegin(z, out, sizeof(out));  // short
+  TEST_ASSERT_TRUE(inflateFeed(z, 0x80));
+  TEST_ASSERT_TRUE(inflateFeed(z, 0x04));
+  TEST_ASSERT_FALSE(inflateComplete(z));
+}
+
+void test_bin_frame_compressed() {
+  const std::vector<uint8_t> expected = lzExpected();
+  const std::vector<uint8_t> pkt = lzPacket(LZ_OPS, 9, true, 42);
+  std::vector<uint8_t> out(expected.size());
+  BinFrameParser p;
+  TEST_ASSERT_TRUE(isBinFrameMagic(pkt[0]));
+  TEST_ASSERT_EQUAL(pkt.size(), feedPacket(p, pkt, out.data(), 9));
+  TEST_ASSERT_TRUE(p.sequenced);
+  TEST_ASSERT_TRUE(p.compressed);
+  TEST_ASSERT_EQUAL_HEX32(42, p.seq);
+  TEST_ASSERT_EQUAL_HEX16(p.expectedCrc, p.crc);
+  TEST_ASSERT_TRUE(binFrameDecoded(p));
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(expected.data(), out.data(), expected.size());
+
+  // The same payload can't fill a larger frame.
+  std::vector<uint8_t> big(3 * 10);
+  const std::vector<uint8_t> pkt10 = lzPacket(LZ_OPS, 10, false, 0);
+  TEST_ASSERT_EQUAL(pkt10.size(), feedPacket(p, pkt10, big.data(), 10));
+  TEST_ASSERT_EQUAL_HEX16(p.expectedCrc, p.crc);
+  TEST_ASSERT_FALSE(binFrameDecoded(p));
+}
+
+// Every chunk size must decode the same body, with bytes split across chunks.
+void test_hex_stream_chunks() {
+  const std::vector<uint8_t> bytes = pattern(3 * 35);
+  const std::string body = "  " + toHex(bytes) + "\r\n";
+  std::vector<uint8_t> out(bytes.size());
+  for (size_t chunk = 1; chunk <= body.size(); chunk++) {
+    HexStreamDecoder d;
+    hexStreamBegin(d, out.data(), out.size());
+    for (size_t i = 0; i < body.size(); i += chunk) {
+      const size_t n = body.size() - i < chunk ? body.size() - i : chunk;
+      TEST_ASSERT_TRUE(hexStreamFeed(d, reinterpret_cast<const uint8_t*>(body.data() + i), n));
+    }
+    TEST_ASSERT_TRUE(hexStreamComplete(d));
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(bytes.data(), out.data(), bytes.size());
+  }
+}
+
+void test_hex_stream_rejects() {
+  uint8_t out[6];
+  HexStreamDecoder d;
+  const char* shortBody = "0102";
+  hexStreamBegin(d, out, sizeof(out));
+  TEST_ASSERT_TRUE(hexStreamFeed(d, reinterpret_cast<const uint8_t*>(shortBody), strlen(shortBody)));
+  TEST_ASSERT_FALSE(hexStreamComplete(d));
+
+  const char* longBody = "01020304050607";
+  hexStreamBegin(d, out, sizeof(out));
+  TEST_ASSERT_FALSE(hexStreamFeed(d, reinterpret_cast<const uint8_t*>(longBody), strlen(longBody)));
+
+  const char* gap = "010203 040506";
+  hexStreamBegin(d, out, sizeof(out));
+  TEST_ASSERT_FALSE(hexStreamFeed(d, reinterpret_cast<const uint8_t*>(gap), strlen(gap)));
+
+  const char* badDigit = "0102030405zz";
+  hexStreamBegin(d, out, sizeof(out));
+  TEST_ASSERT_FALSE(hexStreamFeed(d, reinterpret_cast<const uint8_t*>(badDigit), strlen(badDigit)));
+
+  const char* odd = "01020304050";
+  hexStreamBegin(d, out, sizeof(out));
+  TEST_ASSERT_TRUE(hexStreamFeed(d, reinterpret_cast<const uint8_t*>(odd), strlen(odd)));
+  TEST_ASSERT_FALSE(hexStreamComplete(d));
+}
+
+void test_tokenizer() {
+  char line[] = "  SET 12\t-3  x7 ";
+  char* cursor = line;
+  TEST_ASSERT_EQUAL_STRING("SET", nextToken(cursor));
+  int v = 0;
+  TEST_ASSERT_TRUE(nextInt(cursor, v));
+  TEST_ASSERT_EQUAL_INT(12, v);
+  TEST_ASSERT_TRUE(nextInt(cursor, v));
+  TEST_ASSERT_EQUAL_INT(-3, v);
+  TEST_ASSERT_FALSE(atEnd(cursor));
+  TEST_ASSERT_FALSE(nextInt(cursor, v));
+  TEST_ASSERT_TRUE(atEnd(cursor));
+  TEST_ASSERT_NULL(nextToken(cursor));
+
+  char padded[] = "FRAME 00 \r\n";
+  TEST_ASSERT_EQUAL(8, trimEnd(padded, strlen(padded)));
+  TEST_ASSERT_EQUAL_STRING("FRAME 00", padded);
+}
+
+void test_parse_seq() {
+  uint32_t seq = 0;
+  TEST_ASSERT_TRUE(parseSeq("0", seq));
+  TEST_ASSERT_EQUAL_UINT32(0, seq);
+  TEST_ASSERT_TRUE(parseSeq("4294967295", seq));
+  TEST_ASSERT_EQUAL_UINT32(0xFFFFFFFF, seq);
+  TEST_ASSERT_FALSE(parseSeq("4294967296", seq));
+  TEST_ASSERT_FALSE(parseSeq("", seq));
+  TEST_ASSERT_FALSE(parseSeq("-1", seq));
+  TEST_ASSERT_FALSE(parseSeq("12a", seq));
+}
+
+static void cmdEcho(char* args, Response& res) {
+  char* tok = nextToken(args);
+  res.format("OK %s", tok != nullptr ? tok : "-");
+}
+
+static void cmdFail(char* args, Response& res) {
+  res.set("ERR nope");
+}
+
+static const CommandEntry TEST_COMMANDS[] = {
+    {"ECHO", cmdEcho},
+    {"FAIL", cmdFail},
+};
+
+void test_dispatch() {
+  char buf[32];
+  Response res{buf, sizeof(buf)};
+  char line[] = "echo hello";
+  TEST_ASSERT_EQUAL_PTR(&TEST_COMMANDS[0], dispatchCommand(TEST_COMMANDS, 2, line, res));
+  TEST_ASSERT_EQUAL_STRING("OK hello", buf);
+  TEST_ASSERT_TRUE(res.ok());
+
+  char fail[] = "Fail";
+  TEST_ASSERT_EQUAL_PTR(&TEST_COMMANDS[1], dispatchCommand(TEST_COMMANDS, 2, fail, res));
+  TEST_ASSERT_FALSE(res.ok());
+
+  char unknown[] = "NOPE 1";
+  TEST_ASSERT_NULL(dispatchCommand(TEST_COMMANDS, 2, unknown, res));
+  char blank[] = "   ";
+  TEST_ASSERT_NULL(dispatchCommand(TEST_COMMANDS, 2, blank, res));
+}
+
+void test_response_truncates() {
+  char buf[8];
+  Response res{buf, sizeof(buf)};
+  res.set("OK");
+  res.append(" %d", 12345);
+  TEST_ASSERT_EQUAL_STRING("OK 1234", buf);
+  res.append(" %d", 6);
+  TEST_ASSERT_EQUAL_STRING("OK 1234", buf);
+  res.set("ERR too long");
+  TEST_ASSERT_EQUAL_STRING("ERR too", buf);
+}
+
+void test_line_assembler() {
+  char buf[9];
+  LineAssembler line(buf, 8);
+  const char* input = "PING\r\n";
+  LineStatus st = LINE_PENDING;
+  for (const char* c = input; *c != '\0'; c++) st = lineFeed(line, *c);
+  TEST_ASSERT_EQUAL(LINE_READY, st);
+  TEST_ASSERT_EQUAL_STRING("PING", buf);
+
+  line.len = 0;
+  const char* overlong = "123456789\nOK\n";
+  int tooLong = 0;
+  int ready = 0;
+  for (const char* c = overlong; *c != '\0'; c++) {
+    st = lineFeed(line, *c);
+    if (st == LINE_TOO_LONG) tooLong++;
+    if (st == LINE_READY) ready++;
+  }
+  TEST_ASSERT_EQUAL(1, tooLong);
+  TEST_ASSERT_EQUAL(1, ready);
+  TEST_ASSERT_EQUAL_STRING("OK", buf);
+
+  line.len = 0;
+  for (const char* c = "12345678\n"; *c != '\0'; c++) st = lineFeed(line, *c);
+  TEST_ASSERT_EQUAL(LINE_READY, st);
+  TEST_ASSERT_EQUAL_STRING("12345678", buf);
+}
+
+void test_output_lut() {
+  uint8_t lut[256];
+  buildOutputLut(lut, 1.0f, 255);
+  for (int i = 0; i < 256; i++) TEST_ASSERT_EQUAL_UINT8(i, lut[i]);
+
+  buildOutputLut(lut, 2.2f, 255);
+  TEST_ASSERT_EQUAL_UINT8(0, lut[0]);
+  TEST_ASSERT_EQUAL_UINT8(255, lut[255]);
+  TEST_ASSERT_EQUAL_UINT8(56, lut[128]);  // 255 * (128 / 255)^2.2
+  for (int i = 1; i < 256; i++) TEST_ASSERT_TRUE(lut[i] >= lut[i - 1]);
+
+  buildOutputLut(lut, 1.0f, 200);
+  TEST_ASSERT_EQUAL_UINT8(200, lut[255]);
+  TEST_ASSERT_EQUAL_UINT8(100, lut[128]);
+}
+
+void test_power_limit() {
+  const uint16_t leds = 100;
+  const uint32_t white = leds * pixelLoad(255, 255, 255);
+  // 100 LEDs of full white: 100 * (16 + 11 + 15) + 100 idle.
+  TEST_ASSERT_EQUAL_UINT32(4300, estimateCurrentMa(white, leds, 255));
+  TEST_ASSERT_EQUAL_UINT32(100, estimateCurrentMa(0, leds, 255));
+
+  TEST_ASSERT_EQUAL_UINT8(255, limitBrightness(white, leds, 255, 0));     // unlimited
+  TEST_ASSERT_EQUAL_UINT8(255, limitBrightness(white, leds, 255, 5000));  // fits
+  TEST_ASSERT_EQUAL_UINT8(32, limitBrightness(white, leds, 32, 2000));    // fits when dimmed
+
+  const uint8_t limited = limitBrightness(white, leds, 255, 2000);
+  TEST_ASSERT_TRUE(limited < 255);
+  TEST_ASSERT_TRUE(estimateCurrentMa(white, leds, limited) <= 2000);
+  TEST_ASSERT_TRUE(estimateCurrentMa(white, leds, limited + 1) > 2000);
+
+  TEST_ASSERT_EQUAL_UINT8(0, limitBrightness(white, leds, 255, 50));  // below the idle draw
+}
+
+void test_timeline_segment() {
+  const uint32_t at[] = {0, 1000, 3000};
+  uint8_t amount = 0;
+  TEST_ASSERT_EQUAL_UINT8(1, timelineSegment(at, 3, 0, amount));  // at key 0, heading for key 1
+  TEST_ASSERT_EQUAL_UINT8(0, amount);
+  TEST_ASSERT_EQUAL_UINT8(1, timelineSegment(at, 3, 500, amount));
+  TEST_ASSERT_EQUAL_UINT8(127, amount);
+  TEST_ASSERT_EQUAL_UINT8(2, timelineSegment(at, 3, 1000, amount));
+  TEST_ASSERT_EQUAL_UINT8(0, amount);
+  TEST_ASSERT_EQUAL_UINT8(2, timelineSegment(at, 3, 2999, amount));
+  TEST_ASSERT_EQUAL_UINT8(254, amount);
+  TEST_ASSERT_EQUAL_UINT8(2, timelineSegment(at, 3, 3000, amount));
+  TEST_ASSERT_EQUAL_UINT8(255, amount);
+  TEST_ASSERT_EQUAL_UINT8(2, timelineSegment(at, 3, 0xFFFFFFFF, amount));
+  TEST_ASSERT_EQUAL_UINT8(255, amount);
+
+  // Before a first keyframe past 0 the timeline comes from the starting frame.
+  const uint32_t late[] = {400};
+  TEST_ASSERT_EQUAL_UINT8(0, timelineSegment(late, 1, 100, amount));
+  TEST_ASSERT_EQUAL_UINT8(63, amount);
+}
+
+void test_grid_wiring_position() {
+  // The 5x7 wall: wired up and down the columns, starting bottom right.
+  GridGeometry wall;
+  wall.cols = 5;
+  wall.rows = 7;
+  wall.columnMajor = true;
+  wall.startRight = true;
+  wall.startBottom = true;
+  wall.serpentine = true;
+  TEST_ASSERT_EQUAL_UINT16(0, gridWiringPosition(wall, 4, 6));
+  TEST_ASSERT_EQUAL_UINT16(6, gridWiringPosition(wall, 4, 0));
+  TEST_ASSERT_EQUAL_UINT16(7, gridWiringPosition(wall, 3, 0));  // the next column runs back down
+  TEST_ASSERT_EQUAL_UINT16(13, gridWiringPosition(wall, 3, 6));
+  TEST_ASSERT_EQUAL_UINT16(34, gridWiringPosition(wall, 0, 0));
+
+  GridGeometry rows;
+  rows.cols = 4;
+  rows.rows = 3;
+  TEST_ASSERT_EQUAL_UINT16(0, gridWiringPosition(rows, 0, 0));
+  TEST_ASSERT_EQUAL_UINT16(5, gridWiringPosition(rows, 1, 1));
+  rows.serpentine = true;
+  TEST_ASSERT_EQUAL_UINT16(6, gridWiringPosition(rows, 1, 1));
+  TEST_ASSERT_EQUAL_UINT16(11, gridWiringPosition(rows, 3, 2));
+}
+
+void test_parse_grid_rect() {
+  GridRect rect;
+  TEST_ASSERT_TRUE(parseGridRect("3,4", rect));
+  TEST_ASSERT_EQUAL_UINT16(3, rect.col0);
+  TEST_ASSERT_EQUAL_UINT16(3, rect.col1);
+  TEST_ASSERT_EQUAL_UINT16(4, rect.row0);
+  TEST_ASSERT_EQUAL_UINT16(4, rect.row1);
+  TEST_ASSERT_TRUE(parseGridRect("4,0:1,6", rect));  // any two opposite corners
+  TEST_ASSERT_EQUAL_UINT16(1, rect.col0);
+  TEST_ASSERT_EQUAL_UINT16(4, rect.col1);
+  TEST_ASSERT_EQUAL_UINT16(0, rect.row0);
+  TEST_ASSERT_EQUAL_UINT16(6, rect.row1);
+
+  TEST_ASSERT_FALSE(parseGridRect("", rect));
+  TEST_ASSERT_FALSE(parseGridRect("3", rect));
+  TEST_ASSERT_FALSE(parseGridRect("3,", rect));
+  TEST_ASSERT_FALSE(parseGridRect("3,4:", rect));
+  TEST_ASSERT_FALSE(parseGridRect("3,4:5", rect));
+  TEST_ASSERT_FALSE(parseGridRect("3,4x", rect));
+  TEST_ASSERT_FALSE(parseGridRect("-1,4", rect));
+  TEST_ASSERT_FALSE(parseGridRect("70000,1", rect));
+}
+
+void test_latency_histogram() {
+  LatencyStat st;
+  TEST_ASSERT_EQUAL_UINT32(0, latencyPercentile(st, 50));
+  for (int i = 0; i < 98; i++) recordLatency(st, 10);  // bucket 0 (< 16us)
+  recordLatency(st, 100);                               // bucket 3 (< 128us)
+  recordLatency(st, 1000000);                           // open-ended last bucket
+  TEST_ASSERT_EQUAL_UINT32(100, st.count);
+  TEST_ASSERT_EQUAL_UINT32(1000000, st.maxUs);
+  TEST_ASSERT_EQUAL_UINT32(98, st.buckets[0]);
+  TEST_ASSERT_EQUAL_UINT32(1, st.buckets[3]);
+  TEST_ASSERT_EQUAL_UINT32(1, st.buckets[LATENCY_BUCKETS - 1]);
+  TEST_ASSERT_EQUAL_UINT32(16, latencyPercentile(st, 50));
+  TEST_ASSERT_EQUAL_UINT32(128, latencyPercentile(st, 99));
+  TEST_ASSERT_EQUAL_UINT32(1000000, latencyPercentile(st, 100));
+
+  LatencyStat one;
+  recordLatency(one, 3);
+  TEST_ASSERT_EQUAL_UINT32(3, latencyPercentile(one, 99));  // capped at the max
+}
+
+int main(int argc, char** argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_parse_hex_byte);
+  RUN_TEST(test_decode_hex8_matches_table);
+  RUN_TEST(test_decode_hex);
+  RUN_TEST(test_indexed_frame);
+  RUN_TEST(test_crc16);
+  RUN_TEST(test_bin_frame_plain);
+  RUN_TEST(test_bin_frame_sequenced);
+  RUN_TEST(test_bin_frame_bad_crc);
+  RUN_TEST(test_bin_frame_count_mismatch);
+  RUN_TEST(test_bin_frame_empty);
+  RUN_TEST(test_inflate);
+  RUN_TEST(test_inflate_rejects);
+  RUN_TEST(test_bin_frame_compressed);
+  RUN_TEST(test_hex_stream_chunks);
+  RUN_TEST(test_hex_stream_rejects);
+  RUN_TEST(test_tokenizer);
+  RUN_TEST(test_parse_seq);
+  RUN_TEST(test_dispatch);
+  RUN_TEST(test_response_truncates);
+  RUN_TEST(test_line_assembler);
+  RUN_TEST(test_output_lut);
+  RUN_TEST(test_power_limit);
+  RUN_TEST(test_timeline_segment);
+  RUN_TEST(test_grid_wiring_position);
+  RUN_TEST(test_parse_grid_rect);
+  RUN_TEST(test_latency_histogram);
+  return UNITY_END();
+}